@@ -0,0 +1,221 @@
+// Asynchronous link layer benchmark.
+// A transmitter queues buffers with llsubmit and a receiver collects them with
+// llpoll, each from an epoll loop of its own on lleventfd(), over a pair of
+// pseudo-terminals joined in this process. Both sides run in child processes
+// (the link layer keeps one connection per process) and report back through a
+// pipe: the buffers that went through, how many events each wakeup of the loop
+// collected and whether every buffer arrived as it was sent.
+//
+// Usage: async_bench [-n buffers] [-s buffer size]
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "link_layer.h"
+#include "ll_async.h"
+#include "utils.h"
+
+#define DEFAULT_BUFFERS 2000
+#define BAUDRATE        9600        // Not paced: the ptys run as fast as they can
+#define N_TRIES         3
+#define TIMEOUT         4
+#define RUN_LIMIT       60          // Seconds before the benchmark gives up
+#define EVENTS          64          // Events collected per llpoll
+#define RELAY_SIZE      4096
+
+typedef struct {
+    LinkLayerRole role;
+    int done;                       // Buffers acknowledged (Tx) or received (Rx)
+    int failed;                     // LlSendFailed (Tx) or damaged buffers (Rx)
+    long events, wakeups;
+    int opened, closed;             // The LlOpened result and llcloseasync
+} Report;
+
+long long now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int openPty(char *slavePath, int size, int *slave){
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) return -1;
+    if(ptsname_r(master, slavePath, size) != 0) return -1;
+
+    struct termios tio;
+    *slave = open(slavePath, O_RDWR | O_NOCTTY);
+    if(*slave < 0 || tcgetattr(*slave, &tio) < 0) return -1;
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    return master;
+}
+
+// Byte j of buffer i
+unsigned char pattern(int i, int j){
+    return (unsigned char) (i * 7 + j);
+}
+
+// One side of the transfer, from its own event loop
+void runSide(const char *port, LinkLayerRole role, int n, int size, int out){
+    LinkLayer params;
+    memset(&params, 0, sizeof(params));
+    snprintf(params.serialPort, sizeof(params.serialPort), "%s", port);
+    params.role = role;
+    params.baudRate = BAUDRATE;
+    params.nRetransmissions = N_TRIES;
+    params.timeout = TIMEOUT;
+
+    Report r;
+    memset(&r, 0, sizeof(r));
+    r.role = role;
+    unsigned char *buffers = (unsigned char *) malloc((size_t) n * size);
+    for(int i = 0; i < n && role == LlTx; i++)
+        for(int j = 0; j < size; j++) buffers[(size_t) i * size + j] = pattern(i, j);
+
+    if(llopenasync(params, NULL, NULL) < 0) exit(1);
+    int ep = epoll_create1(0);
+    struct epoll_event ev = {EPOLLIN, {0}};
+    epoll_ctl(ep, EPOLL_CTL_ADD, lleventfd(), &ev);
+
+    int submitted = 0, finished = FALSE;
+    while(!finished){
+        while(role == LlTx && r.opened > 0 && submitted < n &&
+              llsubmit(buffers + (size_t) submitted * size, size, NULL) > 0) submitted++;
+
+        struct epoll_event ready;
+        if(epoll_wait(ep, &ready, 1, RUN_LIMIT * 1000) <= 0) break;
+        r.wakeups++;
+
+        LlEvent events[EVENTS];
+        int k;
+        while((k = llpoll(events, EVENTS)) > 0){
+            r.events += k;
+            for(int i = 0; i < k; i++){
+                LlEvent *e = &events[i];
+                if(e->type == LlOpened){
+                    r.opened = e->size;
+                    if(e->size < 0) finished = TRUE;
+                }
+                else if(e->type == LlSent) r.done++;
+                else if(e->type == LlSendFailed) r.failed++;
+                else if(e->type == LlReceived){
+                    int intact = e->size == size;
+                    for(int j = 0; j < e->size && intact; j++)
+                        intact = e->data[j] == pattern(r.done, j);
+                    if(!intact) r.failed++;
+                    r.done++;
+                    free(e->data);
+                }
+                else if(e->type == LlClosed) finished = TRUE;
+            }
+        }
+        if(role == LlTx && r.done + r.failed == n) finished = TRUE;
+    }
+
+    r.closed = llcloseasync(FALSE);
+    write(out, &r, sizeof(r));
+    free(buffers);
+    exit(0);
+}
+
+pid_t spawn(const char *port, LinkLayerRole role, int n, int size, int out){
+    fflush(NULL);
+    pid_t pid = fork();
+    if(pid != 0) return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    runSide(port, role, n, size, out);
+    return 0;
+}
+
+// Carry bytes between the two masters until both sides have reported
+void relay(int a, int b, int reports, long long limit){
+    unsigned char buf[RELAY_SIZE];
+    struct pollfd fds[3] = {{a, POLLIN, 0}, {b, POLLIN, 0}, {reports, POLLIN, 0}};
+
+    while(now() < limit){
+        if(poll(fds, 3, 100) <= 0) continue;
+        for(int i = 0; i < 2; i++){
+            if(!(fds[i].revents & POLLIN)) continue;
+            int r = read(fds[i].fd, buf, sizeof(buf));
+            if(r > 0) write(fds[1 - i].fd, buf, r);
+        }
+        if(fds[2].revents & (POLLIN | POLLHUP)) return;
+    }
+}
+
+int main(int argc, char *argv[]){
+    int n = DEFAULT_BUFFERS, size = MAX_PAYLOAD_SIZE, opt;
+
+    while((opt = getopt(argc, argv, "n:s:")) != -1){
+        switch(opt){
+            case 'n': n = atoi(optarg); break;
+            case 's': size = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-n buffers] [-s buffer size]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(n <= 0 || size <= 0 || size > MAX_PAYLOAD_SIZE){
+        printf("[ERROR - Invalid Parameters]\n");
+        return 1;
+    }
+
+    char txPort[64], rxPort[64];
+    int txSlave, rxSlave, reports[2];
+    int txMaster = openPty(txPort, sizeof(txPort), &txSlave);
+    int rxMaster = openPty(rxPort, sizeof(rxPort), &rxSlave);
+    if(txMaster < 0 || rxMaster < 0 || pipe(reports) < 0){
+        perror("Opening ptys");
+        return 1;
+    }
+
+    printf("---- ASYNC LINK LAYER BENCH ----\n");
+    printf("Buffers: %d of %d Bytes, %s > %s\n", n, size, txPort, rxPort);
+
+    long long start = now();
+    pid_t rx = spawn(rxPort, LlRx, n, size, reports[1]);
+    pid_t tx = spawn(txPort, LlTx, n, size, reports[1]);
+    close(reports[1]);
+
+    // Either side writes its report once it is done; the relay runs until both have
+    Report side[2], report;
+    int got = 0;
+    long long limit = start + RUN_LIMIT * 1000000000LL;
+    while(got < 2 && now() < limit){
+        relay(txMaster, rxMaster, reports[0], limit);
+        if(read(reports[0], &report, sizeof(report)) != sizeof(report)) break;
+        side[report.role == LlTx ? 0 : 1] = report;
+        got++;
+    }
+    double seconds = (now() - start) / 1e9;
+
+    kill(tx, SIGTERM);
+    kill(rx, SIGTERM);
+    waitpid(tx, NULL, 0);
+    waitpid(rx, NULL, 0);
+    if(got < 2){
+        printf("[ERROR - Only %d of the 2 sides finished]\n", got);
+        return 1;
+    }
+
+    Report *t = &side[0], *r = &side[1];
+    printf("Transfer: %d/%d buffers in %.3f s (%.1f kB/s), %d damaged, %d send failures\n",
+           r->done, n, seconds, (double) r->done * size / seconds / 1e3, r->failed, t->failed);
+    printf("Events per wakeup: Tx %.1f (%ld), Rx %.1f (%ld)\n",
+           t->wakeups ? (double) t->events / t->wakeups : 0, t->events,
+           r->wakeups ? (double) r->events / r->wakeups : 0, r->events);
+    printf("Close: Tx %d, Rx %d\n", t->closed, r->closed);
+    return r->done == n && r->failed == 0 && t->failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,412 @@
+// Protocol efficiency benchmark.
+// Runs real transfers through the application and link layers over an emulated
+// line and compares the measured efficiency S with the stop-and-wait model.
+//
+// The line is a pair of pseudo-terminals joined by a relay in this process. The
+// relay paces each direction to the baud rate (8N1, 10 bits per byte), adds a
+// one-way propagation delay and corrupts I frames at a given frame error rate.
+//
+// Usage: bench [-b bauds] [-p packet sizes] [-e frame error rates] [-d delays (ms)]
+//              [-s synthetic file size] [-x] [-o results.csv] [files...]
+// Each list is comma separated. By default each parameter is swept on its own
+// around the first value of the other lists; -x runs the full grid instead.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "application_layer.h"
+#include "crc.h"
+#include "frame_decoder.h"
+#include "link_layer.h"
+#include "utils.h"
+
+#define MAX_VALUES      16          // Values per swept parameter
+#define MAX_FILES       8
+#define CHUNK_SIZE      64          // Bytes per queued chunk, bounds the pacing granularity
+#define QUEUE_SIZE      4096        // Chunks in flight per direction
+#define BITS_PER_BYTE   10          // 8N1: start + 8 data + stop bits
+#define N_TRIES         3
+#define TIMEOUT         4
+#define RUN_LIMIT       600         // Seconds before a run is abandoned
+#define ACK_SIZE        6           // RR with credit
+
+typedef struct {
+    long long release;              // ns, when the chunk leaves the line
+    int size;
+    unsigned char data[CHUNK_SIZE];
+} Chunk;
+
+typedef struct {
+    int in, out;                    // master fds: read from in, deliver to out
+    Chunk queue[QUEUE_SIZE];
+    int head, tail;
+    long long lineFree;             // ns, when the line finishes the last queued byte
+    int frameIndex, corrupt;        // position since the last FLAG, and whether to damage this frame
+    int opaque;                     // bytes of a length-prefixed I frame after the header, FLAGs included
+} Direction;
+
+typedef struct {
+    int baud, packet;
+    double fer, delay;              // delay in ms
+} Point;
+
+#define MAX_POINTS      1024
+
+// Framing of the I frames, as the transfers take it from RCOM_FRAMING and RCOM_FCS
+int rawFraming = FALSE;
+int checkSize = 1;
+
+double values[4][MAX_VALUES];
+int nValues[4] = {0};
+const char *files[MAX_FILES];
+int nFiles = 0;
+
+long long now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int parseList(const char *arg, double *list){
+    char copy[256];
+    strncpy(copy, arg, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+
+    int n = 0;
+    for(char *tok = strtok(copy, ","); tok != NULL && n < MAX_VALUES; tok = strtok(NULL, ","))
+        list[n++] = atof(tok);
+    return n;
+}
+
+// Create a pseudo-terminal pair. Returns the master fd and fills the slave path and fd.
+// The slave is kept open here too, so the master never sees a hangup while the programs reopen it.
+int openPty(char *slavePath, int size, int *slave){
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) return -1;
+    if(ptsname_r(master, slavePath, size) != 0) return -1;
+
+    struct termios tio;
+    *slave = open(slavePath, O_RDWR | O_NOCTTY);
+    if(*slave < 0 || tcgetattr(*slave, &tio) < 0) return -1;
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    return master;
+}
+
+// Corrupt the first payload byte of an I frame with probability fer.
+// Frames are told apart by their C byte: S and U frames (SET and UA carry an options byte, RR
+// a credit byte) are never damaged and take no roll. The payload starts after BCC1, or after
+// the length and header check of a length-prefixed frame, whose bytes up to the frame check
+// are passed over whole since they are not stuffed. The damaged byte never becomes FLAG or
+// ESC_B1 so framing is kept.
+void injectErrors(Direction *dir, unsigned char *buf, int n, double fer){
+    int payload = rawFraming ? 3 + RAW_HEADER_SIZE : 4;    // frameIndex of the first payload byte
+
+    for(int i = 0; i < n; i++){
+        if(dir->opaque > 0){
+            dir->opaque--;
+            dir->frameIndex++;
+        }
+        else if(buf[i] == FLAG){
+            dir->frameIndex = 0;
+            dir->corrupt = FALSE;
+            continue;
+        }
+        else dir->frameIndex++;
+
+        if(dir->frameIndex == 2 && (buf[i] & ~(CI_1 | NR_BIT | AGG_BIT)) == 0){
+            dir->corrupt = drand48() < fer;
+            if(rawFraming) dir->opaque = RAW_HEADER_SIZE;
+        }
+        // Length, least significant byte first: the payload and the frame check follow the header
+        else if(rawFraming && dir->frameIndex == 3) dir->opaque += buf[i];
+        else if(rawFraming && dir->frameIndex == 4) dir->opaque += (buf[i] << 8) + checkSize;
+
+        if(dir->corrupt && dir->frameIndex == payload){
+            unsigned char damaged = buf[i] ^ 0x01;
+            if(damaged != FLAG && damaged != ESC_B1) buf[i] = damaged;
+            else buf[i] ^= 0x02;
+            dir->corrupt = FALSE;
+        }
+    }
+}
+
+void enqueue(Direction *dir, const unsigned char *buf, int n, const Point *pt){
+    long long byteTime = 1000000000LL * BITS_PER_BYTE / pt->baud;
+    long long t = now();
+
+    for(int off = 0; off < n; off += CHUNK_SIZE){
+        int size = n - off > CHUNK_SIZE ? CHUNK_SIZE : n - off;
+        if((dir->tail + 1) % QUEUE_SIZE == dir->head) return; // line overrun: drop
+
+        if(dir->lineFree < t) dir->lineFree = t;
+        dir->lineFree += size * byteTime;
+
+        Chunk *c = &dir->queue[dir->tail];
+        c->release = dir->lineFree + (long long) (pt->delay * 1e6);
+        c->size = size;
+        memcpy(c->data, buf + off, size);
+        dir->tail = (dir->tail + 1) % QUEUE_SIZE;
+    }
+}
+
+// Deliver every chunk whose time has come. Returns ns until the next release, or -1 if empty.
+long long release(Direction *dir){
+    long long t = now();
+    while(dir->head != dir->tail){
+        Chunk *c = &dir->queue[dir->head];
+        if(c->release > t) return c->release - t;
+        write(dir->out, c->data, c->size);
+        dir->head = (dir->head + 1) % QUEUE_SIZE;
+    }
+    return -1;
+}
+
+pid_t spawn(const char *port, const char *role, const Point *pt, const char *file){
+    fflush(NULL);   // the child exits through exit(), don't let it flush our buffers twice
+    pid_t pid = fork();
+    if(pid != 0) return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    char size[16];
+    snprintf(size, sizeof(size), "%d", pt->packet);
+    setenv("RCOM_PACKET_SIZE", size, 1);
+
+    applicationLayer(port, role, pt->baud, N_TRIES, TIMEOUT, file);
+    exit(0);
+}
+
+int sameFiles(const char *a, const char *b){
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while(same){
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if(ca != cb) same = FALSE;
+        if(ca == EOF) break;
+    }
+    if(fa != NULL) fclose(fa);
+    if(fb != NULL) fclose(fb);
+    return same;
+}
+
+// Stop-and-wait efficiency for the frames a file of "size" bytes is cut into:
+// S = (1 - p) * Tdata / (Tframe + Tack + 2 * Tprop)
+double theoryStopAndWait(long size, const Point *pt){
+    int data = pt->packet - D_SIZE;
+    long frames = (size + data - 1) / data;
+    double byteTime = (double) BITS_PER_BYTE / pt->baud;
+    double tprop = pt->delay / 1000.0;
+
+    double useful = size * byteTime;
+    double cycle = (size + frames * (D_SIZE + H_SIZE)) * byteTime + frames * (ACK_SIZE * byteTime + 2 * tprop);
+    return (1 - pt->fer) * useful / cycle;
+}
+
+// Run one transfer. Returns the elapsed time in seconds, or -1 if it failed.
+double runTransfer(const char *file, const Point *pt, const char *received){
+    char txPort[64], rxPort[64];
+    Direction tx2rx, rx2tx;
+    memset(&tx2rx, 0, sizeof(tx2rx));
+    memset(&rx2tx, 0, sizeof(rx2tx));
+
+    int sTx, sRx;
+    int mTx = openPty(txPort, sizeof(txPort), &sTx);
+    int mRx = openPty(rxPort, sizeof(rxPort), &sRx);
+    if(mTx < 0 || mRx < 0){
+        perror("openpty");
+        exit(-1);
+    }
+    tx2rx.in = rx2tx.out = mTx;
+    tx2rx.out = rx2tx.in = mRx;
+
+    unlink(received);
+    pid_t rx = spawn(rxPort, "rx", pt, received);
+    usleep(100000);     // let the receiver open and flush its port before the SET arrives
+
+    long long start = now();
+    pid_t tx = spawn(txPort, "tx", pt, file);
+    long long end = 0;
+    int running = 2;
+
+    while(running > 0){
+        long long waitTx = release(&tx2rx), waitRx = release(&rx2tx);
+        long long wait = waitTx < 0 ? waitRx : (waitRx < 0 || waitTx < waitRx ? waitTx : waitRx);
+        int timeout = wait < 0 ? 10 : (int) (wait / 1000000) + 1;
+        if(timeout > 10) timeout = 10;
+
+        struct pollfd fds[2] = {{mTx, POLLIN, 0}, {mRx, POLLIN, 0}};
+        if(poll(fds, 2, timeout) > 0){
+            unsigned char buf[BUF_SIZE * 4];
+            for(int i = 0; i < 2; i++){
+                if(!(fds[i].revents & POLLIN)) continue;
+                Direction *dir = i == 0 ? &tx2rx : &rx2tx;
+                int n = read(fds[i].fd, buf, sizeof(buf));
+                if(n <= 0) continue;
+                if(dir == &tx2rx && pt->fer > 0) injectErrors(dir, buf, n, pt->fer);
+                enqueue(dir, buf, n, pt);
+            }
+        }
+
+        int status;
+        pid_t done;
+        while((done = waitpid(-1, &status, WNOHANG)) > 0){
+            if(done == tx) end = now();
+            running--;
+        }
+
+        if(running > 0 && now() - start > RUN_LIMIT * 1000000000LL){
+            kill(tx, SIGKILL);
+            kill(rx, SIGKILL);
+        }
+    }
+
+    close(mTx);
+    close(mRx);
+    close(sTx);
+    close(sRx);
+
+    if(end == 0 || !sameFiles(file, received)) return -1;
+    return (end - start) / 1e9;
+}
+
+// List the points to run: the full grid, or each parameter swept on its own around the
+// base point made of the first value of every list.
+int buildPoints(Point *points, int grid){
+    int n = 0, index[4];
+
+    if(grid){
+        int total = nValues[0] * nValues[1] * nValues[2] * nValues[3];
+        for(int i = 0; i < total && n < MAX_POINTS; i++){
+            int rest = i;
+            for(int k = 3; k >= 0; k--){
+                index[k] = rest % nValues[k];
+                rest /= nValues[k];
+            }
+            Point pt = {values[0][index[0]], values[1][index[1]], values[2][index[2]], values[3][index[3]]};
+            points[n++] = pt;
+        }
+        return n;
+    }
+
+    for(int axis = 0; axis < 4; axis++){
+        for(int v = axis == 0 ? 0 : 1; v < nValues[axis] && n < MAX_POINTS; v++){
+            memset(index, 0, sizeof(index));
+            index[axis] = v;
+            Point pt = {values[0][index[0]], values[1][index[1]], values[2][index[2]], values[3][index[3]]};
+            points[n++] = pt;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]){
+    const char *csvPath = "bench.csv";
+    long synthSize = 32768;
+    int grid = FALSE;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:p:e:d:s:o:x")) != -1){
+        switch(opt){
+            case 'b': nValues[0] = parseList(optarg, values[0]); break;
+            case 'p': nValues[1] = parseList(optarg, values[1]); break;
+            case 'e': nValues[2] = parseList(optarg, values[2]); break;
+            case 'd': nValues[3] = parseList(optarg, values[3]); break;
+            case 's': synthSize = atol(optarg); break;
+            case 'o': csvPath = optarg; break;
+            case 'x': grid = TRUE; break;
+            default:
+                printf("Usage: %s [-b bauds] [-p packet sizes] [-e frame error rates] [-d delays (ms)]\n"
+                       "          [-s synthetic file size] [-x] [-o results.csv] [files...]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if(nValues[0] == 0) nValues[0] = parseList("38400,9600,19200,115200", values[0]);
+    if(nValues[1] == 0) nValues[1] = parseList("1000,128,256,512", values[1]);
+    if(nValues[2] == 0) nValues[2] = parseList("0,0.02,0.05,0.1", values[2]);
+    if(nValues[3] == 0) nValues[3] = parseList("0,20,50,100", values[3]);
+
+    for(int i = optind; i < argc && nFiles < MAX_FILES; i++)
+        files[nFiles++] = argv[i];
+
+    char synthPath[] = "/tmp/bench-synthetic-XXXXXX";
+    if(nFiles == 0){
+        files[nFiles++] = "penguin.gif";
+        if(synthSize > 0){
+            int sfd = mkstemp(synthPath);
+            srand48(synthSize);
+            for(long i = 0; i < synthSize; i++){
+                unsigned char b = lrand48() & 0xFF;
+                write(sfd, &b, 1);
+            }
+            close(sfd);
+            files[nFiles++] = synthPath;
+        }
+    }
+
+    FILE *csv = fopen(csvPath, "w");
+    if(csv == NULL){
+        perror(csvPath);
+        exit(-1);
+    }
+    fprintf(csv, "file,bytes,baud,packet_size,frame_error_rate,delay_ms,time_s,throughput_Bps,S_measured,S_stop_and_wait\n");
+
+    Point points[MAX_POINTS];
+    int nPoints = buildPoints(points, grid);
+    signal(SIGPIPE, SIG_IGN);
+    const char *framing = getenv("RCOM_FRAMING"), *fcs = getenv("RCOM_FCS");
+    rawFraming = framing != NULL && strcmp(framing, "length") == 0;
+    if(fcs != NULL && fcsType(fcs) >= 0) checkSize = fcsSize(fcsType(fcs));
+
+    srand48(1);
+
+    printf("%-28s %8s %6s %6s %6s %8s %10s %8s %8s\n", "File", "Baud", "Packet", "FER", "Delay", "Time (s)",
+           "Rate (B/s)", "S", "S_sw");
+
+    for(int f = 0; f < nFiles; f++){
+        struct stat st;
+        if(stat(files[f], &st) < 0){
+            perror(files[f]);
+            continue;
+        }
+
+        for(int p = 0; p < nPoints; p++){
+            Point pt = points[p];
+            char received[64];
+            snprintf(received, sizeof(received), "/tmp/bench-received-%d", getpid());
+
+            double seconds = runTransfer(files[f], &pt, received);
+            double rate = seconds > 0 ? st.st_size / seconds : 0;
+            double measured = rate * BITS_PER_BYTE / pt.baud;
+            double theory = theoryStopAndWait(st.st_size, &pt);
+
+            fprintf(csv, "%s,%ld,%d,%d,%.4f,%.1f,%.3f,%.1f,%.4f,%.4f\n", files[f], (long) st.st_size, pt.baud,
+                    pt.packet, pt.fer, pt.delay, seconds, rate, measured, theory);
+            fflush(csv);
+
+            if(seconds < 0)
+                printf("%-28s %8d %6d %6.3f %6.0f %8s %10s %8s %8.4f\n", files[f], pt.baud, pt.packet, pt.fer,
+                       pt.delay, "FAILED", "-", "-", theory);
+            else
+                printf("%-28s %8d %6d %6.3f %6.0f %8.3f %10.1f %8.4f %8.4f\n", files[f], pt.baud, pt.packet,
+                       pt.fer, pt.delay, seconds, rate, measured, theory);
+            unlink(received);
+        }
+    }
+
+    fclose(csv);
+    if(nFiles > 0 && strcmp(files[nFiles - 1], synthPath) == 0) unlink(synthPath);
+    printf("\nResults written to %s\n", csvPath);
+    return 0;
+}
@@ -0,0 +1,278 @@
+// Cable startup and scaling benchmark.
+// Launches many cables side by side, each with its ports in a directory of its
+// own and one or more lanes, and times how long each takes to be ready. The
+// same bytes are then pushed through every lane at once and checked on the
+// other side, and the cables are stopped with SIGTERM, which must leave no
+// links behind. "-n N -l 1" against "-n 1 -l N" compares N processes with one
+// process serving N lanes.
+//
+// Usage: cable_bench [-n cables] [-l lanes per cable] [-b bytes per lane] [-d directory] [-c cable program]
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CABLES  100
+#define DEFAULT_BYTES   65536
+#define DEFAULT_CABLE   "bin/cable"
+#define MAX_CABLES      1000
+#define MAX_LANES       1000        // In all the cables
+#define CHUNK_SIZE      4096
+#define RUN_LIMIT       60          // Seconds before the benchmark gives up
+#define READY           "Cable ready"
+
+typedef struct {
+    pid_t pid;
+    int out;                        // Read end of the cable's stdout
+    char seen[sizeof(READY)];       // Last bytes of its output
+    long long started, ready;       // ns
+} Cable;
+
+typedef struct {
+    int tx, rx;                     // The two ports, opened as the programs would
+    long sent, received;
+    int intact;
+} Lane;
+
+static Cable cables[MAX_CABLES];
+static Lane lanes[MAX_LANES];
+
+long long nowNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Byte "offset" of what lane i sends
+unsigned char pattern(int i, long offset){
+    return (unsigned char) (offset * 31 + i);
+}
+
+// Directory of cable i's ports
+void portDir(const char *base, int i, char *dir, int size){
+    snprintf(dir, size, "%s/%d", base, i);
+}
+
+int spawnCable(Cable *c, const char *program, const char *dir, int laneCount){
+    char count[16];
+    snprintf(count, sizeof(count), "%d", laneCount);
+
+    int out[2];
+    if(pipe(out) < 0) return -1;
+
+    c->started = nowNs();
+    c->pid = fork();
+    if(c->pid < 0) return -1;
+    if(c->pid == 0){
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        execl(program, program, "-d", dir, "-L", count, "-s", "0", (char *) NULL);
+        perror(program);
+        exit(1);
+    }
+    close(out[1]);
+    c->out = out[0];
+    fcntl(c->out, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+// Read what a cable printed. Returns TRUE once it has said it is ready.
+int readOutput(Cable *c){
+    char buf[512];
+    int n;
+    while((n = read(c->out, buf, sizeof(buf))) > 0){
+        for(int i = 0; i < n; i++){
+            memmove(c->seen, c->seen + 1, sizeof(c->seen) - 2);
+            c->seen[sizeof(c->seen) - 2] = buf[i];
+            if(strcmp(c->seen, READY) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+// Port ttyS<number> of a cable, numbered as the cable numbers them
+int openPort(const char *dir, int number){
+    char path[256];
+    snprintf(path, sizeof(path), "%s/ttyS%d", dir, number);
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    struct termios tio;
+    if(fd < 0 || tcgetattr(fd, &tio) < 0) return -1;
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+    return fd;
+}
+
+// Move bytes through every lane until all arrived or time runs out.
+// Returns the number of lanes whose bytes all arrived as they were sent.
+int transfer(int n, long bytes){
+    static struct pollfd fds[2 * MAX_LANES];
+    unsigned char buf[CHUNK_SIZE];
+    long long limit = nowNs() + RUN_LIMIT * 1000000000LL;
+    int done = 0;
+
+    for(int i = 0; i < n; i++) lanes[i].intact = 1;
+    while(done < n && nowNs() < limit){
+        for(int i = 0; i < n; i++){
+            Lane *l = &lanes[i];
+            fds[2 * i].fd = l->sent < bytes ? l->tx : -1;
+            fds[2 * i].events = POLLOUT;
+            fds[2 * i + 1].fd = l->received < bytes ? l->rx : -1;
+            fds[2 * i + 1].events = POLLIN;
+        }
+        if(poll(fds, 2 * n, 100) <= 0) continue;
+
+        for(int i = 0; i < n; i++){
+            Lane *l = &lanes[i];
+            if(fds[2 * i].revents & POLLOUT){
+                int size = bytes - l->sent < CHUNK_SIZE ? bytes - l->sent : CHUNK_SIZE;
+                for(int j = 0; j < size; j++) buf[j] = pattern(i, l->sent + j);
+                int w = write(l->tx, buf, size);
+                if(w > 0) l->sent += w;
+            }
+            if(fds[2 * i + 1].revents & POLLIN){
+                int r = read(l->rx, buf, sizeof(buf));
+                for(int j = 0; j < r; j++)
+                    if(buf[j] != pattern(i, l->received + j)) l->intact = 0;
+                if(r > 0) l->received += r;
+                if(l->received >= bytes) done++;
+            }
+        }
+    }
+
+    int intact = 0;
+    for(int i = 0; i < n; i++)
+        if(lanes[i].received == bytes && lanes[i].intact) intact++;
+    return intact;
+}
+
+int main(int argc, char *argv[]){
+    int n = DEFAULT_CABLES, laneCount = 1;
+    long bytes = DEFAULT_BYTES;
+    const char *program = DEFAULT_CABLE;
+    char base[128];
+    snprintf(base, sizeof(base), "/tmp/cable_bench.%d", (int) getpid());
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:l:b:d:c:")) != -1){
+        switch(opt){
+            case 'n': n = atoi(optarg); break;
+            case 'l': laneCount = atoi(optarg); break;
+            case 'b': bytes = atol(optarg); break;
+            case 'd': snprintf(base, sizeof(base), "%s", optarg); break;
+            case 'c': program = optarg; break;
+            default:
+                printf("Usage: %s [-n cables] [-l lanes per cable] [-b bytes per lane] [-d directory] [-c cable program]\n", argv[0]);
+                return 1;
+        }
+    }
+    int total = n * laneCount;
+    if(n <= 0 || n > MAX_CABLES || laneCount <= 0 || total > MAX_LANES || bytes <= 0){
+        printf("[ERROR - Invalid Parameters]\n");
+        return 1;
+    }
+
+    // Descriptors here: the output of each cable and two ports per lane
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    char dir[256];
+    mkdir(base, 0755);
+    for(int i = 0; i < n; i++){
+        portDir(base, i, dir, sizeof(dir));
+        mkdir(dir, 0755);
+    }
+
+    printf("---- CABLE BENCH ----\n");
+    printf("Cables: %d, lanes per cable: %d, %ld Bytes per lane, ports in %s\n", n, laneCount, bytes, base);
+    fflush(stdout);
+
+    // Start them all, then wait for each to say it is ready
+    long long start = nowNs();
+    for(int i = 0; i < n; i++){
+        portDir(base, i, dir, sizeof(dir));
+        if(spawnCable(&cables[i], program, dir, laneCount) < 0){
+            perror("Starting cable");
+            return 1;
+        }
+    }
+    static struct pollfd fds[MAX_CABLES];
+    int ready = 0;
+    long long limit = nowNs() + RUN_LIMIT * 1000000000LL;
+    while(ready < n && nowNs() < limit){
+        for(int i = 0; i < n; i++){
+            fds[i].fd = cables[i].ready ? -1 : cables[i].out;
+            fds[i].events = POLLIN;
+        }
+        if(poll(fds, n, 100) <= 0) continue;
+        for(int i = 0; i < n; i++){
+            if(!(fds[i].revents & (POLLIN | POLLHUP)) || !readOutput(&cables[i])) continue;
+            cables[i].ready = nowNs();
+            ready++;
+        }
+    }
+    long long allReady = nowNs() - start;
+
+    double sum = 0, worst = 0;
+    for(int i = 0; i < n; i++){
+        if(!cables[i].ready) continue;
+        double ms = (cables[i].ready - cables[i].started) / 1e6;
+        sum += ms;
+        if(ms > worst) worst = ms;
+    }
+    printf("Startup: %d/%d ready, mean %.2f ms, max %.2f ms, all after %.2f ms\n",
+           ready, n, ready > 0 ? sum / ready : 0, worst, allReady / 1e6);
+
+    // Every lane at once; lane k of a cable has ports ttyS(10 + 2k) and ttyS(11 + 2k)
+    int opened = 0;
+    for(int i = 0; i < total && ready == n; i++){
+        portDir(base, i / laneCount, dir, sizeof(dir));
+        int k = i % laneCount;
+        lanes[i].tx = openPort(dir, 10 + 2 * k);
+        lanes[i].rx = openPort(dir, 11 + 2 * k);
+        if(lanes[i].tx >= 0 && lanes[i].rx >= 0) opened++;
+    }
+    if(opened == total){
+        long long t = nowNs();
+        int intact = transfer(total, bytes);
+        double seconds = (nowNs() - t) / 1e9;
+        printf("Transfer: %.0f Bytes in %.3f s (%.1f MB/s aggregate), %d/%d lanes intact\n",
+               (double) bytes * total, seconds, bytes * total / seconds / 1e6, intact, total);
+    }
+    else printf("[ERROR - Opened the ports of %d/%d lanes: %s]\n", opened, total, strerror(errno));
+
+    // Stop them; each removes its links on the way out
+    long long t = nowNs();
+    for(int i = 0; i < n; i++) kill(cables[i].pid, SIGTERM);
+    for(int i = 0; i < n; i++) waitpid(cables[i].pid, NULL, 0);
+    double teardown = (nowNs() - t) / 1e6;
+
+    int left = 0;
+    for(int i = 0; i < total; i++){
+        if(lanes[i].tx > 0) close(lanes[i].tx);
+        if(lanes[i].rx > 0) close(lanes[i].rx);
+    }
+    for(int i = 0; i < n; i++){
+        close(cables[i].out);
+        portDir(base, i, dir, sizeof(dir));
+        if(rmdir(dir) < 0) left++;
+    }
+    rmdir(base);
+    printf("Teardown: %.2f ms, %d directories with links left\n", teardown, left);
+    return 0;
+}
@@ -0,0 +1,186 @@
+// Frame codec microbenchmark.
+// For every frame check and payload size class, times the generic encoder
+// (frame check picked at run time, one branch per byte) against the small and
+// bulk variants generated for that check, and the decoder set to that check.
+// The length-prefixed variant (no stuffing) is timed the same way.
+// Every frame is decoded back and compared with its payload.
+//
+// Usage: codec_bench [-n frames] [-r repeats] [-f flag/escape share (%)]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "frame_decoder.h"
+#include "link_layer.h"
+#include "utils.h"
+
+#define DEFAULT_FRAMES  2048
+#define DEFAULT_REPEATS 10
+
+static const int sizes[] = {4, SMALL_PAYLOAD, 16, 64, 256, MAX_PAYLOAD_SIZE};
+#define SIZES (int) (sizeof(sizes) / sizeof(sizes[0]))
+
+long long nowNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// The encoder before the variants: the check is looked up on every frame and
+// every byte is tested on its own.
+int genericEncode(unsigned char A, unsigned char C, const unsigned char *payload, int size, FCS_TYPE fcs, unsigned char *out){
+    unsigned char check[FCS_MAX_SIZE];
+    fcsCompute(fcs, payload, size, check);
+    int checkSize = fcsSize(fcs);
+
+    int pos = 0;
+    out[pos++] = FLAG;
+    out[pos++] = A;
+    out[pos++] = C;
+    out[pos++] = A ^ C;
+    for(int i = 0; i < size + checkSize; i++){
+        unsigned char b = i < size ? payload[i] : check[i - size];
+        if(b == FLAG){
+            out[pos++] = ESC_B1;
+            out[pos++] = ESC_B2;
+        }
+        else if(b == ESC_B1){
+            out[pos++] = ESC_B1;
+            out[pos++] = ESC_B3;
+        }
+        else out[pos++] = b;
+    }
+    out[pos++] = FLAG;
+    return pos;
+}
+
+typedef int (*Encoder)(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out);
+
+static FCS_TYPE genericCheck;
+
+int runGeneric(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out){
+    return genericEncode(A, C, payload, size, genericCheck, out);
+}
+
+// Encode every frame into stream. Return the time taken, or -1 when the
+// encoder disagrees with the generic one.
+long long timeEncode(Encoder encode, const unsigned char *payloads, int frames, int size,
+                     unsigned char *stream, const unsigned char *reference, int referenceSize){
+    long long start = nowNs();
+    int pos = 0;
+    for(int i = 0; i < frames; i++)
+        pos += encode(AT, i % 2 ? CI_1 : CI_0, payloads + (long) i * size, size, stream + pos);
+    long long ns = nowNs() - start;
+    if(reference != NULL && (pos != referenceSize || memcmp(stream, reference, pos) != 0)) return -1;
+    return ns;
+}
+
+// Decode the stream back. Return the time taken, or -1 when a payload differs.
+long long timeDecode(const FrameCodec *codec, const unsigned char *stream, int streamSize,
+                     const unsigned char *payloads, int frames, int size, unsigned char *packet){
+    FrameDecoder d;
+    Frame frame;
+    decoderInit(&d);
+    decoderSetCodec(&d, codec);
+    decoderSetPayload(&d, packet, MAX_PAYLOAD_SIZE);
+
+    long long start = nowNs();
+    int pos = 0, good = 0;
+    for(int i = 0; i < frames; i++){
+        do pos += decodeFrame(&d, stream + pos, streamSize - pos, &frame);
+        while(frame.kind == FRAME_NONE && pos < streamSize);
+        if(frame.kind == FRAME_I && frame.size == size &&
+           memcmp(packet, payloads + (long) i * size, size) == 0) good++;
+    }
+    long long ns = nowNs() - start;
+    return good == frames ? ns : -1;
+}
+
+int main(int argc, char *argv[]){
+    int frames = DEFAULT_FRAMES, repeats = DEFAULT_REPEATS, share = 1;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:r:f:")) != -1){
+        switch(opt){
+            case 'n': frames = atoi(optarg); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 'f': share = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-n frames] [-r repeats] [-f flag/escape share (%%)]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(frames <= 0 || repeats <= 0 || share < 0 || share > 100){
+        printf("[ERROR - Invalid Parameters]\n");
+        return 1;
+    }
+
+    // Random payloads with the given share of bytes that need stuffing
+    long total = (long) frames * MAX_PAYLOAD_SIZE;
+    unsigned char *payloads = (unsigned char *) malloc(total);
+    unsigned char *reference = (unsigned char *) malloc((long) frames * FRAME_MAX(MAX_PAYLOAD_SIZE));
+    unsigned char *stream = (unsigned char *) malloc((long) frames * FRAME_MAX(MAX_PAYLOAD_SIZE));
+    unsigned char *packet = (unsigned char *) malloc(MAX_PAYLOAD_SIZE + FCS_MAX_SIZE);
+    srand(1);
+    for(long i = 0; i < total; i++){
+        if(rand() % 100 < share) payloads[i] = rand() % 2 ? FLAG : ESC_B1;
+        else{
+            do payloads[i] = rand(); while(payloads[i] == FLAG || payloads[i] == ESC_B1);
+        }
+    }
+
+    printf("---- FRAME CODEC ----\n");
+    printf("Frames: %d per size, %d%% FLAG/ESC, %d repeats, small up to %d Bytes\n", frames, share, repeats, SMALL_PAYLOAD);
+    printf("%-6s %-7s %9s %9s %9s %9s %9s %9s %8s\n", "size", "check", "generic", "small", "bulk", "decode", "raw", "rawdec", "speedup");
+
+    for(int s = 0; s < SIZES; s++){
+        int size = sizes[s];
+        for(int c = 0; c < FCS_TYPES; c++){
+            const FrameCodec *codec = frameCodec(c, FALSE), *raw = frameCodec(c, TRUE);
+            genericCheck = c;
+            long long genericNs = 0, smallNs = 0, bulkNs = 0, decodeNs = 0, rawNs = 0, rawDecodeNs = 0;
+            int referenceSize = 0;
+            for(int i = 0; i < frames; i++)
+                referenceSize += runGeneric(AT, i % 2 ? CI_1 : CI_0, payloads + (long) i * size, size, reference + referenceSize);
+
+            for(int r = 0; r < repeats; r++){
+                long long g = timeEncode(runGeneric, payloads, frames, size, stream, NULL, 0);
+                long long sm = timeEncode(codec->encodeSmall, payloads, frames, size, stream, reference, referenceSize);
+                long long b = timeEncode(codec->encodeBulk, payloads, frames, size, stream, reference, referenceSize);
+                long long d = timeDecode(codec, stream, referenceSize, payloads, frames, size, packet);
+                int rawSize = 0;
+                long long rw = nowNs();
+                for(int i = 0; i < frames; i++)
+                    rawSize += raw->encodeBulk(AT, i % 2 ? CI_1 : CI_0, payloads + (long) i * size, size, stream + rawSize);
+                rw = nowNs() - rw;
+                long long rd = timeDecode(raw, stream, rawSize, payloads, frames, size, packet);
+                if(sm < 0 || b < 0 || d < 0 || rd < 0){
+                    printf("[ERROR - %s codec, %d Bytes: frames differ]\n", fcsName(c), size);
+                    return 1;
+                }
+                genericNs += g;
+                smallNs += sm;
+                bulkNs += b;
+                decodeNs += d;
+                rawNs += rw;
+                rawDecodeNs += rd;
+            }
+
+            // The variant codecEncode picks for this size
+            long long picked = size <= SMALL_PAYLOAD ? smallNs : bulkNs;
+            double bytes = (double) frames * size * repeats;
+            printf("%-6d %-7s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %7.2fx\n", size, fcsName(c), genericNs / bytes,
+                   smallNs / bytes, bulkNs / bytes, decodeNs / bytes, rawNs / bytes, rawDecodeNs / bytes, (double) genericNs / picked);
+        }
+    }
+    printf("Times in ns per payload byte; raw is length-prefixed, without stuffing\n");
+    printf("Speedup of the stuffed variant codecEncode picks over generic\n");
+
+    free(payloads);
+    free(reference);
+    free(stream);
+    free(packet);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Frame check microbenchmark.
+// Times the XOR BCC2 and the CRCs llopen can negotiate over frame-sized
+// payloads, and counts how many corrupted frames each check lets through.
+//
+// Usage: crc_bench [-p payload size] [-n frames] [-r repeats] [-e corrupted frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "crc.h"
+#include "link_layer.h"
+
+#define DEFAULT_FRAMES      4096
+#define DEFAULT_REPEATS     20
+#define DEFAULT_CORRUPTED   100000
+
+long long nowNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+typedef struct {
+    const char *name;
+    FCS_TYPE type;
+    uint32_t (*run)(const unsigned char *buf, size_t len);
+} Check;
+
+uint32_t runXor(const unsigned char *buf, size_t len){ return xorCheck(buf, len); }
+uint32_t runCrc16(const unsigned char *buf, size_t len){ return crc16(buf, len); }
+uint32_t runCrc32(const unsigned char *buf, size_t len){ return crc32(buf, len); }
+uint32_t runCrc32cTable(const unsigned char *buf, size_t len){ return crc32cTable(buf, len); }
+uint32_t runCrc32c(const unsigned char *buf, size_t len){ return crc32c(buf, len); }
+
+int main(int argc, char *argv[]){
+    int payloadSize = MAX_PAYLOAD_SIZE, frames = DEFAULT_FRAMES, repeats = DEFAULT_REPEATS, corrupted = DEFAULT_CORRUPTED;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:n:r:e:")) != -1){
+        switch(opt){
+            case 'p': payloadSize = atoi(optarg); break;
+            case 'n': frames = atoi(optarg); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 'e': corrupted = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-p payload size] [-n frames] [-r repeats] [-e corrupted frames]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(payloadSize <= 0 || payloadSize > MAX_PAYLOAD_SIZE || frames <= 0 || repeats <= 0 || corrupted < 0){
+        printf("[ERROR - Invalid Parameters]\n");
+        return 1;
+    }
+
+    Check checks[] = {
+        {"xor", FCS_XOR, runXor},
+        {"crc16", FCS_CRC16, runCrc16},
+        {"crc32", FCS_CRC32, runCrc32},
+        {"crc32c/t", FCS_CRC32C, runCrc32cTable},
+        {"crc32c", FCS_CRC32C, runCrc32c},
+    };
+    int nChecks = sizeof(checks) / sizeof(checks[0]);
+
+    unsigned char *payloads = (unsigned char *) malloc((long) frames * payloadSize);
+    srand(1);
+    for(long i = 0; i < (long) frames * payloadSize; i++) payloads[i] = rand();
+
+    printf("---- FRAME CHECK ----\n");
+    printf("Frames: %d x %d Bytes, %d repeats; crc32c on %s\n", frames, payloadSize, repeats,
+           crc32cHardware() ? "SSE4.2" : "tables");
+    printf("%-9s %6s %10s %10s %12s\n", "check", "bytes", "ns/byte", "MB/s", "undetected");
+
+    double bytes = (double) frames * payloadSize * repeats;
+    unsigned char *copy = (unsigned char *) malloc(payloadSize);
+    for(int c = 0; c < nChecks; c++){
+        volatile uint32_t sink = 0;
+        long long start = nowNs();
+        for(int r = 0; r < repeats; r++)
+            for(int i = 0; i < frames; i++)
+                sink ^= checks[c].run(payloads + (long) i * payloadSize, payloadSize);
+        long long ns = nowNs() - start;
+        (void) sink;
+
+        // Corrupt 2 to 4 bytes of a frame and see whether the check still matches
+        int undetected = 0;
+        srand(2);
+        for(int e = 0; e < corrupted; e++){
+            const unsigned char *frame = payloads + (long) (e % frames) * payloadSize;
+            memcpy(copy, frame, payloadSize);
+            int errors = 2 + rand() % 3;
+            for(int k = 0; k < errors; k++) copy[rand() % payloadSize] ^= 1 + rand() % 255;
+            if(memcmp(copy, frame, payloadSize) != 0 &&
+               checks[c].run(copy, payloadSize) == checks[c].run(frame, payloadSize)) undetected++;
+        }
+
+        printf("%-9s %6d %10.3f %10.1f %7d/%d\n", checks[c].name, fcsSize(checks[c].type), ns / bytes, bytes / (ns / 1e9) / 1e6, undetected, corrupted);
+    }
+
+    free(payloads);
+    free(copy);
+    return 0;
+}
@@ -0,0 +1,191 @@
+// Deframing microbenchmark.
+// Decodes the same stream of stuffed I frames with the per-byte state machine
+// llread used before the table-driven decoder and with decodeFrame, checks that
+// both give the same payloads, and reports the time per byte of each.
+//
+// Usage: deframe_bench [-p payload size] [-n frames] [-r repeats] [-f flag/escape share (%)]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "frame_decoder.h"
+#include "link_layer.h"
+#include "utils.h"
+
+#define DEFAULT_FRAMES  4096
+#define DEFAULT_REPEATS 20
+
+long long nowNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Build an I frame around payload into out, as llwrite does. Return its size.
+int buildFrame(const unsigned char *payload, int size, int num, unsigned char *out){
+    unsigned char C = num == 0 ? CI_0 : CI_1;
+    unsigned char bcc2 = 0;
+    int pos = 0;
+
+    out[pos++] = FLAG;
+    out[pos++] = AT;
+    out[pos++] = C;
+    out[pos++] = AT ^ C;
+    for(int i = 0; i <= size; i++){
+        unsigned char b = i < size ? payload[i] : bcc2;
+        if(i < size) bcc2 ^= b;
+        if(b == FLAG){
+            out[pos++] = ESC_B1;
+            out[pos++] = ESC_B2;
+        }
+        else if(b == ESC_B1){
+            out[pos++] = ESC_B1;
+            out[pos++] = ESC_B3;
+        }
+        else out[pos++] = b;
+    }
+    out[pos++] = FLAG;
+    return pos;
+}
+
+// The per-byte state machine llread ran before the table-driven decoder.
+// Return the payload size of the next frame, -1 on a bad frame or -2 at the end of the stream.
+int legacyDecode(const unsigned char *in, int n, int *pos, int expected, unsigned char *packet){
+    STATE state = START;
+    unsigned char c = 0, aux = 0;
+    int index = 0;
+
+    while(*pos < n){
+        unsigned char byte = in[(*pos)++];
+        switch(state){
+            case START:
+                if(byte == FLAG) state = FLAG_RCV;
+                break;
+            case FLAG_RCV:
+                if(byte == AT) state = A_RCV;
+                else if(byte != FLAG) state = START;
+                break;
+            case A_RCV:
+                if(byte == (expected == 0 ? CI_0 : CI_1)){
+                    state = C_RCV;
+                    c = byte;
+                }
+                else if(byte == FLAG) state = FLAG_RCV;
+                else state = START;
+                break;
+            case C_RCV:
+                if(byte == (AT ^ c)) state = READING;
+                else if(byte == FLAG) state = FLAG_RCV;
+                else state = START;
+                break;
+            case READING:
+                if(byte == ESC_B1) state = BYTE_STUFF;
+                else if(byte == FLAG){
+                    packet[--index] = 0;
+                    return aux == 0 ? index : -1;
+                }
+                else{
+                    packet[index++] = byte;
+                    aux ^= byte;
+                }
+                break;
+            case BYTE_STUFF:
+                state = READING;
+                if(byte == ESC_B2) packet[index++] = FLAG;
+                else if(byte == ESC_B3) packet[index++] = ESC_B1;
+                else return -1;
+                aux ^= packet[index - 1];
+                break;
+            default:
+                break;
+        }
+    }
+    return -2;
+}
+
+int main(int argc, char *argv[]){
+    int payloadSize = MAX_PAYLOAD_SIZE, frames = DEFAULT_FRAMES, repeats = DEFAULT_REPEATS, share = 1;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:n:r:f:")) != -1){
+        switch(opt){
+            case 'p': payloadSize = atoi(optarg); break;
+            case 'n': frames = atoi(optarg); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 'f': share = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-p payload size] [-n frames] [-r repeats] [-f flag/escape share (%%)]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(payloadSize <= 0 || payloadSize > MAX_PAYLOAD_SIZE || frames <= 0 || repeats <= 0 || share < 0 || share > 100){
+        printf("[ERROR - Invalid Parameters]\n");
+        return 1;
+    }
+
+    // Random payloads with the given share of bytes that need stuffing
+    unsigned char *payloads = (unsigned char *) malloc((long) frames * payloadSize);
+    unsigned char *stream = (unsigned char *) malloc((long) frames * (2 * payloadSize + 8));
+    srand(1);
+    for(long i = 0; i < (long) frames * payloadSize; i++){
+        if(rand() % 100 < share) payloads[i] = rand() % 2 ? FLAG : ESC_B1;
+        else{
+            do payloads[i] = rand(); while(payloads[i] == FLAG || payloads[i] == ESC_B1);
+        }
+    }
+
+    int streamSize = 0;
+    for(int i = 0; i < frames; i++)
+        streamSize += buildFrame(payloads + (long) i * payloadSize, payloadSize, i % 2, stream + streamSize);
+
+    unsigned char *packet = (unsigned char *) malloc(MAX_PAYLOAD_SIZE + 1);
+    long long legacyNs = 0, tableNs = 0;
+
+    for(int r = 0; r < repeats; r++){
+        long long start = nowNs();
+        int pos = 0, good = 0;
+        for(int i = 0; i < frames; i++){
+            int size = legacyDecode(stream, streamSize, &pos, i % 2, packet);
+            if(size == payloadSize && memcmp(packet, payloads + (long) i * payloadSize, size) == 0) good++;
+        }
+        legacyNs += nowNs() - start;
+        if(good != frames){
+            printf("[ERROR - Legacy decoder: %d/%d frames]\n", good, frames);
+            return 1;
+        }
+
+        FrameDecoder d;
+        Frame frame;
+        decoderInit(&d);
+        decoderSetPayload(&d, packet, MAX_PAYLOAD_SIZE);
+        start = nowNs();
+        pos = good = 0;
+        for(int i = 0; i < frames; i++){
+            do pos += decodeFrame(&d, stream + pos, streamSize - pos, &frame);
+            while(frame.kind == FRAME_NONE && pos < streamSize);
+            if(frame.kind == FRAME_I && frame.size == payloadSize &&
+               memcmp(packet, payloads + (long) i * payloadSize, frame.size) == 0) good++;
+        }
+        tableNs += nowNs() - start;
+        if(good != frames){
+            printf("[ERROR - Table decoder: %d/%d frames]\n", good, frames);
+            return 1;
+        }
+    }
+
+    double bytes = (double) streamSize * repeats;
+    printf("---- DEFRAMING ----\n");
+    printf("Frames: %d x %d Bytes, %d%% FLAG/ESC, %d Bytes on the line, %d repeats\n",
+           frames, payloadSize, share, streamSize, repeats);
+    printf("%-8s %10s %10s\n", "decoder", "ns/byte", "MB/s");
+    printf("%-8s %10.3f %10.1f\n", "legacy", legacyNs / bytes, bytes / (legacyNs / 1e9) / 1e6);
+    printf("%-8s %10.3f %10.1f\n", "table", tableNs / bytes, bytes / (tableNs / 1e9) / 1e6);
+    printf("Speedup: %.2fx\n", (double) legacyNs / tableNs);
+
+    free(payloads);
+    free(stream);
+    free(packet);
+    return 0;
+}
@@ -1,26 +1,74 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports: the cable opens a
+// pseudo-terminal for each and links its slave as ttyS10 / ttyS11 in /dev, or
+// in the directory given with "-d", so several cables can run side by side.
+// With "-n N" the cable fans out to N receivers (multicast): what the
+// transmitter sends reaches every receiver, and the frames of the receivers
+// are merged towards the transmitter one whole frame at a time.
+// The cable sleeps in poll() until a port or stdin has data, and prints the
+// bytes it forwarded once per period ("-s seconds") instead of a line per
+// read; "-v" brings the line per read back.
+// With "-L N" one cable carries N independent lanes, each a cable of its own
+// (ports, impairments, counters, on/off) served by the same loop.
+// Seeded impairments (bit errors, bursts, frame drops, duplicates, delays and
+// disconnections, see impair.h) are set with "-i setting" or "-f script".
+// "-b bits per second" and "-l ms" pace each direction to a line rate and add
+// a propagation delay.
+// "-w file" records what the cable carries into a pcapng capture (see capture.h).
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-// Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
-#define BAUDRATE B38400
-#define _POSIX_SOURCE 1 // POSIX compliant source
+#include "capture.h"
+#include "impair.h"
+
 #define FALSE 0
 #define TRUE 1
 
-#define BUF_SIZE 2048
+#define BUF_SIZE 65536      // Largest read: a pty hands over whatever it holds
+#define MAX_RECEIVERS 8
+#define FLAG 0x7E
+#define STATS_PERIOD 1      // Seconds between counter lines
+#define IDLE_FLUSH_MS 100   // Fan-out: quiet time after which an incomplete frame is forwarded anyway
+#define PORT_DIR "/dev"     // Where the ports are linked by default
+#define FIRST_PORT 10       // The transmitter is ttyS10, the receivers ttyS11 on, then the next lane
+#define MAX_LANES 256
+#define PATH_SIZE 256
+
+// One end of the cable: a pseudo-terminal whose slave the programs open
+typedef struct
+{
+    int fd;                // Master, the cable's side
+    int slave;             // Kept open so the master never sees a hangup
+    char pty[64];          // Slave path, such as /dev/pts/3
+    char link[PATH_SIZE];  // Link to the slave, such as /dev/ttyS10
+    int linked;
+} Port;
+
+// Receiver side of the cable
+typedef struct
+{
+    int fd;
+    unsigned char pending[2 * BUF_SIZE]; // Bytes of a frame not yet complete (fan-out only)
+    int pendingSize;
+    int scanned;                         // Bytes of pending already scanned for FLAGs
+    int inFrame;
+} Receiver;
 
 typedef enum
 {
@@ -29,31 +77,180 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Traffic of one direction of the cable
+typedef struct
 {
-    int fd = open(serialPort, O_RDWR | O_NOCTTY);
+    long long bytes;   // Bytes read from the sending side
+    long long reads;   // Reads they took
+    long long lost;    // Bytes thrown away while the cable was off
+    long long unread;  // Bytes the receiving side did not take in time
+    ImpairCounts done; // What the impairments did
+} Counters;
+
+// One independent cable: a transmitter, its receivers and the line between
+typedef struct
+{
+    Port ports[1 + MAX_RECEIVERS]; // The transmitter, then the receivers
+    Receiver rx[MAX_RECEIVERS];
+    Outlet out[1 + MAX_RECEIVERS]; // What each port has not taken yet, same order as ports
+    Impairment *impair;            // Tx>Rx, Rx>Tx
+    Queue queue[2];                // Bytes on their way, same order
+    Counters count[2], last[2];    // Same order; last is at the last counters line
+    CableMode mode;
+    long long lastRead;
+} Lane;
+
+Lane *lanes;
+int laneCount = 1;
+int receivers = 1;
+int verbose = FALSE;
+volatile sig_atomic_t stop = FALSE;
+
+long long cableStart;
+Capture capture;
+
+long long nowMs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
 
-    if (fd < 0)
-        return -1;
+// Milliseconds left until deadline, 0 when it has passed
+int untilMs(long long deadline, long long now)
+{
+    return deadline > now ? deadline - now : 0;
+}
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
-        return -1;
+// Make *wait (ms, -1 for none) no later than deadline
+void waitUntil(int *wait, long long deadline, long long now)
+{
+    int left = untilMs(deadline, now);
+    if (*wait < 0 || left < *wait)
+        *wait = left;
+}
+
+void countRead(Counters *c, int n, CableMode cableMode)
+{
+    c->bytes += n;
+    c->reads++;
+    if (cableMode == CableModeOff)
+        c->lost += n;
+}
+
+void printImpaired(const ImpairCounts *now, const ImpairCounts *last)
+{
+    if (now->bitErrors > last->bitErrors)
+        printf(", %lld bit errors", now->bitErrors - last->bitErrors);
+    if (now->dropped > last->dropped)
+        printf(", %lld dropped", now->dropped - last->dropped);
+    if (now->duplicated > last->duplicated)
+        printf(", %lld duplicated", now->duplicated - last->duplicated);
+    if (now->delayed > last->delayed)
+        printf(", %lld delayed", now->delayed - last->delayed);
+    if (now->cut > last->cut)
+        printf(", %lld cut", now->cut - last->cut);
+}
+
+// Start of a line about lane k; nothing on a single lane cable
+void printLane(int k)
+{
+    if (laneCount > 1)
+        printf("Lane %d: ", k);
+}
+
+// One line with the traffic of a lane since the last one; nothing when it was idle.
+void printCounters(int k, double seconds)
+{
+    Lane *l = &lanes[k];
+    Counters *now = l->count, *last = l->last;
+    now[0].done = l->impair[0].done;
+    now[1].done = l->impair[1].done;
+    now[0].unread = 0;
+    for (int i = 1; i <= receivers; i++)
+        now[0].unread += l->out[i].dropped;
+    now[1].unread = l->out[0].dropped;
+    if (now[0].reads == last[0].reads && now[1].reads == last[1].reads)
+        return;
+
+    const char *names[2] = {"Tx>Rx", "Rx>Tx"};
+    printLane(k);
+    for (int d = 0; d < 2; d++)
+    {
+        long long bytes = now[d].bytes - last[d].bytes;
+        printf("%s %lld bytes in %lld reads (%.1f kB/s)", names[d], bytes,
+               now[d].reads - last[d].reads, bytes / seconds / 1000);
+        if (now[d].lost > last[d].lost)
+            printf(", %lld lost", now[d].lost - last[d].lost);
+        if (now[d].unread > last[d].unread)
+            printf(", %lld not taken", now[d].unread - last[d].unread);
+        printImpaired(&now[d].done, &last[d].done);
+        printf(d == 0 ? " | " : "\n");
+    }
+    last[0] = now[0];
+    last[1] = now[1];
+}
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 1; // Inter-character timer unused
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+void onSignal(int signal)
+{
+    stop = TRUE;
+}
+
+// Point link at target. Only a symbolic link, such as one left behind by a
+// cable that was killed, is replaced, never a file or a real device.
+int linkPort(const char *link, const char *target)
+{
+    struct stat st;
+    if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+        unlink(link);
+    return symlink(target, link);
+}
+
+// Create the pseudo-terminal of a port and link it. The slave is raw until
+// the program that opens it sets it up. The master never blocks the cable:
+// what the port does not take waits in its outlet. Returns "0" on success or "-1".
+int openPort(Port *p, const char *dir, int number)
+{
+    p->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (p->fd < 0 || grantpt(p->fd) < 0 || unlockpt(p->fd) < 0)
+        return -1;
+    if (ptsname_r(p->fd, p->pty, sizeof(p->pty)) != 0)
+        return -1;
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+    struct termios tio;
+    p->slave = open(p->pty, O_RDWR | O_NOCTTY);
+    if (p->slave < 0 || tcgetattr(p->slave, &tio) < 0)
         return -1;
+    cfmakeraw(&tio);
+    tcsetattr(p->slave, TCSANOW, &tio);
+
+    // Without the link (no rights on the directory) the pty path still works
+    snprintf(p->link, sizeof(p->link), "%s/ttyS%d", dir, number);
+    p->linked = linkPort(p->link, p->pty) == 0;
+    if (!p->linked)
+        printf("Cannot link %s: %s\n", p->link, strerror(errno));
+    return 0;
+}
 
-    return fd;
+// Close a port and remove its link, unless another cable has taken it over.
+void closePort(Port *p)
+{
+    char target[sizeof(p->pty)];
+    ssize_t n = readlink(p->link, target, sizeof(target) - 1);
+    if (p->linked && n > 0)
+    {
+        target[n] = '\0';
+        if (strcmp(target, p->pty) == 0)
+            unlink(p->link);
+    }
+    close(p->slave);
+    close(p->fd);
+}
+
+// Path a program opens for a port
+const char *portPath(const Port *p)
+{
+    return p->linked ? p->link : p->pty;
 }
 
 // Add noise to a buffer, by flipping the byte in the "errorIndex" position.
@@ -62,154 +259,484 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
     buf[errorIndex] ^= 0xFF;
 }
 
-int main(int argc, char *argv[])
+// Fan-out: append bytes from a receiver and return how many of them, from the
+// start of pending, make up whole frames. Receivers don't hear each other, so
+// forwarding part of a frame could interleave it with another receiver's.
+int completeFrames(Receiver *r, const unsigned char *buf, int n)
 {
-    printf("\n");
+    if (r->pendingSize + n > (int)sizeof(r->pending))
+        n = sizeof(r->pending) - r->pendingSize;
+    memcpy(r->pending + r->pendingSize, buf, n);
+    r->pendingSize += n;
 
-    system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
-    sleep(1);
-    printf("\n");
+    int complete = 0;
+    for (int i = r->scanned; i < r->pendingSize; i++)
+    {
+        // A FLAG right after the opening one opens the frame instead, as in impairFeed: the
+        // one before it closed a frame whose opening FLAG was lost, and goes on its own
+        if (r->pending[i] == FLAG && r->inFrame && i > 0 && r->pending[i - 1] == FLAG)
+            complete = i;
+        else if (r->pending[i] == FLAG)
+            r->inFrame = !r->inFrame;
+        if (!r->inFrame)
+            complete = i + 1;
+    }
+    r->scanned = r->pendingSize;
 
-    system("socat -dd PTY,link=/dev/ttyS11,mode=777 PTY,link=/dev/emulatorRx,mode=777 &");
-    sleep(1);
+    // A receiver that sends garbage without FLAGs can't hold the cable
+    if (r->pendingSize == (int)sizeof(r->pending))
+    {
+        r->inFrame = FALSE;
+        complete = r->pendingSize;
+    }
+    return complete;
+}
 
-    printf("\n\n"
-           "Transmitter must open /dev/ttyS10\n"
-           "Receiver must open /dev/ttyS11\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- noise        : add fixed noise to the cable\n"
-           "--- end          : terminate the program\n"
-           "\n");
+// Pass n bytes read from one side of a lane (0: Tx>Rx, 1: Rx>Tx) through it:
+// the interactive mode first, then the impairments. What gets through is queued.
+void carry(Lane *l, int d, unsigned char *buf, int n, long long now)
+{
+    countRead(&l->count[d], n, l->mode);
+    if (l->mode == CableModeOff)
+    {
+        queueLost(&l->queue[d], buf, n, MARK_OFF);
+        return;
+    }
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+    int marks = 0;
+    if (l->mode == CableModeNoise)
+    {
+        addNoiseToBuffer(buf, 0);
+        marks = MARK_NOISE;
+    }
+    impairFeed(&l->impair[d], buf, n, marks, now, cableStart, &l->queue[d]);
+}
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
+// Forward the first n pending bytes of a receiver and keep the rest.
+void forwardPending(Lane *l, Receiver *r, int n, long long now)
+{
+    if (n == 0)
+        return;
+
+    carry(l, 1, r->pending, n, now);
+    memmove(r->pending, r->pending + n, r->pendingSize - n);
+    r->pendingSize -= n;
+    r->scanned -= n;
+}
+
+// Read from the ports of a lane and write what is due. Each port has its slot
+// in fds, from first on.
+void serveLane(int k, const struct pollfd *fds, long long now)
+{
+    static unsigned char tx2rx[BUF_SIZE];
+    static unsigned char rx2tx[BUF_SIZE];
+    Lane *l = &lanes[k];
+    int fdTx = l->ports[0].fd;
 
-    if (fdTx < 0)
+    // Read from Tx
+    int bytesFromTx = (fds[0].revents & (POLLIN | POLLHUP)) ? read(fdTx, tx2rx, BUF_SIZE) : 0;
+
+    if (bytesFromTx > 0)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        l->lastRead = now;
+        carry(l, 0, tx2rx, bytesFromTx, now);
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+    // Read from Rx
+    int bytesFromRx = 0;
+    for (int i = 0; i < receivers; i++)
+    {
+        int n = (fds[1 + i].revents & (POLLIN | POLLHUP)) ? read(l->rx[i].fd, rx2tx, BUF_SIZE) : 0;
+        if (n > 0)
+        {
+            l->lastRead = now;
+            bytesFromRx += n;
+        }
+
+        if (receivers > 1)
+        {
+            int complete = 0;
+            if (n > 0)
+                complete = completeFrames(&l->rx[i], rx2tx, n);
+            else if (now - l->lastRead >= IDLE_FLUSH_MS)
+            {
+                // The cable went quiet: what is left is not going to become a frame
+                complete = l->rx[i].pendingSize;
+                l->rx[i].inFrame = FALSE;
+            }
+            forwardPending(l, &l->rx[i], complete, now);
+        }
+        else if (n > 0)
+            carry(l, 1, rx2tx, n, now);
+    }
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+    // Write what the ports did not take before, then what is due; every receiver hears the transmitter
+    for (int i = 0; i <= receivers; i++)
+        if (fds[i].revents & POLLOUT)
+            outletFlush(&l->out[i]);
+    int bytesToRx = queueFlush(&l->queue[0], now, &l->out[1], receivers);
+    int bytesToTx = queueFlush(&l->queue[1], now, &l->out[0], 1);
 
-    if (fdRx < 0)
+    if (verbose && bytesFromTx > 0)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        printLane(k);
+        if (l->mode == CableModeOff)
+            printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
+        else if (receivers == 1)
+            printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
+        else
+            printf("bytesFromTx=%d > bytesToRx=%d x %d\n", bytesFromTx, bytesToRx, receivers);
+    }
+    if (verbose && bytesFromRx > 0)
+    {
+        printLane(k);
+        if (l->mode == CableModeOff)
+            printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
+        else
+            printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
     }
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+// Run one interactive command. "lane K command" is for lane K only.
+void runCommand(const char *command)
+{
+    int first = 0, last = laneCount - 1, used = 0;
+    if (sscanf(command, "lane %d %n", &first, &used) == 1 && used > 0)
+    {
+        if (first < 0 || first >= laneCount)
+        {
+            printf("No lane %d\n", first);
+            return;
+        }
+        last = first;
+        command += used;
+    }
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
-    char rxStdin[BUF_SIZE] = {0};
+    CableMode mode;
+    if (strcmp(command, "off") == 0 || strcmp(command, "0") == 0)
+    {
+        printf("CONNECTION OFF");
+        mode = CableModeOff;
+    }
+    else if (strcmp(command, "on") == 0 || strcmp(command, "1") == 0)
+    {
+        printf("CONNECTION ON");
+        mode = CableModeOn;
+    }
+    else if (strcmp(command, "noise") == 0 || strcmp(command, "2") == 0)
+    {
+        printf("CONNECTION NOISE");
+        mode = CableModeNoise;
+    }
+    else
+    {
+        if (strcmp(command, "end") == 0)
+        {
+            printf("END OF THE PROGRAM\n");
+            stop = TRUE;
+        }
+        return;
+    }
 
-    CableMode cableMode = CableModeOn;
-    volatile int STOP = FALSE;
+    if (first == last && laneCount > 1)
+        printf(" (lane %d)", first);
+    printf("\n");
+    for (int k = first; k <= last; k++)
+        lanes[k].mode = mode;
+}
 
-    printf("Cable ready\n");
+void usage(const char *program)
+{
+    printf("Usage: %s [-n receivers] [-L lanes] [-d port directory] [-s seconds between counters, 0 for none] [-v] "
+           "[-i impairment]... [-f impairment script] [-b bits per second] [-l latency ms] [-w capture.pcapng]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *portDir = PORT_DIR;
+    const char *capturePath = NULL;
+    int statsPeriod = STATS_PERIOD;
+    int opt;
+    const char *options = "n:L:d:s:vi:f:b:l:w:";
+
+    // The impairments are for lanes, so they are read once the lanes are known
+    while ((opt = getopt(argc, argv, options)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            receivers = atoi(optarg);
+            break;
+        case 'L':
+            laneCount = atoi(optarg);
+            break;
+        case 'd':
+            portDir = optarg;
+            break;
+        case 's':
+            statsPeriod = atoi(optarg);
+            break;
+        case 'v':
+            verbose = TRUE;
+            break;
+        case 'w':
+            capturePath = optarg;
+            break;
+        case 'i':
+        case 'f':
+        case 'b':
+        case 'l':
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (receivers < 1 || receivers > MAX_RECEIVERS)
+    {
+        printf("Between 1 and %d receivers\n", MAX_RECEIVERS);
+        exit(1);
+    }
+    if (laneCount < 1 || laneCount > MAX_LANES)
+    {
+        printf("Between 1 and %d lanes\n", MAX_LANES);
+        exit(1);
+    }
 
-    while (STOP == FALSE)
+    lanes = calloc(laneCount, sizeof(Lane));
+    Impairment *impair = calloc(2 * laneCount, sizeof(Impairment));
+    if (lanes == NULL || impair == NULL)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        perror("calloc");
+        exit(-1);
+    }
+    impairInit(impair, laneCount);
 
-        if (bytesFromTx > 0)
+    char setting[64];
+    optind = 1;
+    while ((opt = getopt(argc, argv, options)) != -1)
+    {
+        switch (opt)
         {
-            if (cableMode == CableModeOff)
+        case 'i':
+            if (impairParse(impair, laneCount, optarg) < 0)
             {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
+                printf("Bad impairment \"%s\"\n", optarg);
+                exit(1);
             }
-            else
+            break;
+        case 'f':
+            if (impairLoad(impair, laneCount, optarg) < 0)
+                exit(1);
+            break;
+        case 'b':
+        case 'l':
+            // Same as "-i rate BPS" / "-i latency MS"
+            snprintf(setting, sizeof(setting), "%s %s", opt == 'b' ? "rate" : "latency", optarg);
+            if (impairParse(impair, laneCount, setting) < 0)
             {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(tx2rx, 0);
-                }
+                printf("Bad %s \"%s\"\n", opt == 'b' ? "rate" : "latency", optarg);
+                exit(1);
+            }
+            break;
+        }
+    }
+
+    if (capturePath != NULL && captureOpen(&capture, capturePath, laneCount) < 0)
+    {
+        perror(capturePath);
+        exit(1);
+    }
 
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
+    // Lane k's ports are numbered after lane k - 1's
+    for (int k = 0; k < laneCount; k++)
+    {
+        Lane *l = &lanes[k];
+        l->impair = &impair[2 * k];
+        for (int i = 0; i <= receivers; i++)
+        {
+            if (openPort(&l->ports[i], portDir, FIRST_PORT + k * (1 + receivers) + i) < 0)
+            {
+                perror("Opening pseudo-terminal");
+                exit(-1);
             }
         }
+        for (int i = 0; i < receivers; i++)
+            l->rx[i].fd = l->ports[1 + i].fd;
+        for (int i = 0; i <= receivers; i++)
+            l->out[i].fd = l->ports[i].fd;
+    }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
+    printf("\n");
+    for (int k = 0; k < laneCount; k++)
+    {
+        Port *ports = lanes[k].ports;
+        if (laneCount > 1)
+        {
+            printf("Lane %d: transmitter %s, receiver%s", k, portPath(&ports[0]), receivers > 1 ? "s" : "");
+            for (int i = 1; i <= receivers; i++)
+                printf(" %s", portPath(&ports[i]));
+            printf("\n");
+            continue;
+        }
+        printf("Transmitter must open %s\n", portPath(&ports[0]));
+        if (receivers == 1)
+            printf("Receiver must open %s\n", portPath(&ports[1]));
+        else
+            for (int i = 1; i <= receivers; i++)
+                printf("Receiver %d must open %s\n", i, portPath(&ports[i]));
+    }
+    printf("\n"
+           "The cable program is sensible to the following interactive commands:\n"
+           "--- on           : connect the cable and data is exchanged (default state)\n"
+           "--- off          : disconnect the cable disabling data to be exchanged\n"
+           "--- noise        : add fixed noise to the cable\n"
+           "--- end          : terminate the program\n");
+    if (laneCount > 1)
+        printf("--- lane K on|off|noise : the same, for lane K only\n");
+    printf("\n");
+
+    // Killed cables tidy up their links too
+    struct sigaction action = {0};
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-        if (bytesFromRx > 0)
+    char rxStdin[BUF_SIZE] = {0};
+    int stdinOpen = TRUE;
+
+    // poll() set: stdin, then each lane's transmitter and receivers
+    int perLane = 1 + receivers;
+    int nfds = 1 + laneCount * perLane;
+    struct pollfd *fds = calloc(nfds, sizeof(struct pollfd));
+    fds[0].fd = STDIN_FILENO;
+    for (int k = 0; k < laneCount; k++)
+        for (int i = 0; i < perLane; i++)
+            fds[1 + k * perLane + i].fd = lanes[k].ports[i].fd;
+    fds[0].events = POLLIN;
+
+    long long start = nowMs(), lastStats = start;
+    cableStart = start;
+
+    char name[32];
+    for (int k = 0; k < laneCount; k++)
+    {
+        Lane *l = &lanes[k];
+        l->lastRead = start;
+        for (int d = 0; d < 2; d++)
         {
-            if (cableMode == CableModeOff)
+            queueSetLine(&l->queue[d], &l->impair[d]);
+            if (capturePath != NULL)
             {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
+                l->queue[d].capture = &capture;
+                l->queue[d].lane = k;
+                l->queue[d].direction = d;
             }
+            if (laneCount > 1)
+                snprintf(name, sizeof(name), "lane %d %s", k, d == 0 ? "Tx>Rx" : "Rx>Tx");
             else
-            {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(rx2tx, 0);
-                }
+                snprintf(name, sizeof(name), "%s", d == 0 ? "Tx>Rx" : "Rx>Tx");
+            impairPrint(&l->impair[d], name);
+        }
+    }
+    printf("Cable ready\n");
+    fflush(stdout);
 
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
-            }
+    while (!stop)
+    {
+        // Sleep until a side has data, the counters are due, a delayed frame
+        // is due, or an incomplete fan-out frame has waited long enough
+        long long now = nowMs();
+        int wait = -1;
+        if (statsPeriod > 0)
+            waitUntil(&wait, lastStats + statsPeriod * 1000LL, now);
+        for (int k = 0; k < laneCount; k++)
+        {
+            Lane *l = &lanes[k];
+            for (int i = 0; i < receivers && receivers > 1; i++)
+                if (l->rx[i].pendingSize > 0)
+                    waitUntil(&wait, l->lastRead + IDLE_FLUSH_MS, now);
+            for (int d = 0; d < 2; d++)
+                if (queueDue(&l->queue[d]) >= 0)
+                    waitUntil(&wait, queueDue(&l->queue[d]), now);
+
+            // A port that did not take everything is written again once it has room
+            for (int i = 0; i < perLane; i++)
+                fds[1 + k * perLane + i].events = POLLIN | (l->out[i].size > 0 ? POLLOUT : 0);
+        }
+
+        fds[0].fd = stdinOpen ? STDIN_FILENO : -1;
+        if (poll(fds, nfds, wait) < 0)
+            continue;
+        now = nowMs();
+
+        for (int k = 0; k < laneCount; k++)
+            serveLane(k, &fds[1 + k * perLane], now);
+
+        if (statsPeriod > 0 && now - lastStats >= statsPeriod * 1000LL)
+        {
+            for (int k = 0; k < laneCount; k++)
+                printCounters(k, (now - lastStats) / 1000.0);
+            fflush(stdout);
+            captureFlush(&capture);
+            lastStats = now;
         }
 
         // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
+        int fromStdin = (stdinOpen && (fds[0].revents & (POLLIN | POLLHUP))) ? read(STDIN_FILENO, rxStdin, BUF_SIZE - 1) : -1;
+        if (fromStdin == 0)
+            stdinOpen = FALSE;
         if (fromStdin > 0)
         {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
-            }
-            else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
-            {
-                printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
-            }
-            else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
-            {
-                printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
-            }
-            else if (strcmp(rxStdin, "end") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
+            // One command per line; a script piped in may bring several at once
+            rxStdin[fromStdin] = '\0';
+            char *save = NULL;
+            for (char *command = strtok_r(rxStdin, "\r\n", &save); command != NULL; command = strtok_r(NULL, "\r\n", &save))
+                runCommand(command);
+            fflush(stdout);
         }
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    ImpairCounts none = {0};
+    for (int k = 0; k < laneCount; k++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        Lane *l = &lanes[k];
+        if (laneCount > 1)
+            printf("Total lane %d:", k);
+        else
+            printf("Total:");
+        long long unread = 0;
+        for (int i = 1; i <= receivers; i++)
+            unread += l->out[i].dropped;
+        printf(" Tx>Rx %lld bytes in %lld reads, %lld lost", l->count[0].bytes, l->count[0].reads, l->count[0].lost);
+        if (unread > 0)
+            printf(", %lld not taken", unread);
+        printImpaired(&l->impair[0].done, &none);
+        printf(" | Rx>Tx %lld bytes in %lld reads, %lld lost", l->count[1].bytes, l->count[1].reads, l->count[1].lost);
+        if (l->out[0].dropped > 0)
+            printf(", %lld not taken", l->out[0].dropped);
+        printImpaired(&l->impair[1].done, &none);
+        printf("\n");
+
+        for (int i = 0; i <= receivers; i++)
+        {
+            closePort(&l->ports[i]);
+            free(l->out[i].data);
+        }
     }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    if (capturePath != NULL)
     {
-        perror("tcsetattr");
-        exit(-1);
+        printf("Capture: %lld packets, %lld bytes in %s\n", capture.packets, capture.bytes, capturePath);
+        captureClose(&capture);
     }
 
-    close(fdTx);
-    close(fdRx);
-
-    system("killall socat");
-
+    free(fds);
+    free(impair);
+    free(lanes);
     return 0;
 }
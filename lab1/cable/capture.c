@@ -0,0 +1,137 @@
+// Wire capture of the virtual cable, in pcapng.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define BLOCK_SHB 0x0A0D0D0A
+#define BLOCK_IDB 0x00000001
+#define BLOCK_EPB 0x00000006
+#define BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+#define OPT_END 0
+#define OPT_SHB_USERAPPL 4
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS 2
+
+#define EPB_INBOUND 1
+#define EPB_OUTBOUND 2
+
+#define CAPTURE_BUFFER (1 << 20) // Packets are written out a megabyte at a time
+
+// Bytes of padding that take n to a multiple of 4
+static int pad(int n)
+{
+    return (4 - n % 4) % 4;
+}
+
+static void put32(FILE *f, uint32_t v)
+{
+    fwrite(&v, 4, 1, f);
+}
+
+static void putOption(FILE *f, uint16_t code, const void *value, int n)
+{
+    static const unsigned char zeros[4] = {0};
+    uint16_t header[2] = {code, n};
+    fwrite(header, 2, 2, f);
+    if (n > 0)
+        fwrite(value, 1, n, f);
+    fwrite(zeros, 1, pad(n), f);
+}
+
+// Size of an option of n bytes, header and padding included
+static int optionSize(int n)
+{
+    return 4 + n + pad(n);
+}
+
+int captureOpen(Capture *c, const char *path, int lanes)
+{
+    memset(c, 0, sizeof(*c));
+    c->file = fopen(path, "wb");
+    if (c->file == NULL)
+        return -1;
+    setvbuf(c->file, NULL, _IOFBF, CAPTURE_BUFFER);
+    FILE *f = c->file;
+
+    // Section header: byte order, version 1.0, unknown section length
+    const char *application = "RCOM cable";
+    int appSize = strlen(application);
+    uint32_t length = 24 + optionSize(appSize) + optionSize(0) + 4;
+    put32(f, BLOCK_SHB);
+    put32(f, length);
+    put32(f, BYTE_ORDER_MAGIC);
+    uint16_t version[2] = {1, 0};
+    fwrite(version, 2, 2, f);
+    int64_t sectionLength = -1;
+    fwrite(&sectionLength, 8, 1, f);
+    putOption(f, OPT_SHB_USERAPPL, application, appSize);
+    putOption(f, OPT_END, NULL, 0);
+    put32(f, length);
+
+    // One interface per lane, time stamps in nanoseconds
+    for (int k = 0; k < lanes; k++)
+    {
+        char name[32];
+        int nameSize = snprintf(name, sizeof(name), "lane%d", k);
+        unsigned char resolution = 9;
+        length = 16 + optionSize(nameSize) + optionSize(1) + optionSize(0) + 4;
+        put32(f, BLOCK_IDB);
+        put32(f, length);
+        uint16_t linkType[2] = {CAPTURE_LINKTYPE, 0};
+        fwrite(linkType, 2, 2, f);
+        put32(f, 0); // No snap length
+        putOption(f, OPT_IF_NAME, name, nameSize);
+        putOption(f, OPT_IF_TSRESOL, &resolution, 1);
+        putOption(f, OPT_END, NULL, 0);
+        put32(f, length);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+void captureChunk(Capture *c, int lane, int direction, int marks, const unsigned char *data, int n)
+{
+    if (c->file == NULL)
+        return;
+
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    uint64_t ns = t.tv_sec * 1000000000ULL + t.tv_nsec;
+
+    FILE *f = c->file;
+    int captured = CAPTURE_HEADER + n;
+    uint32_t length = 28 + captured + pad(captured) + optionSize(4) + optionSize(0) + 4;
+    uint32_t flags = direction == 0 ? EPB_OUTBOUND : EPB_INBOUND;
+    unsigned char header[CAPTURE_HEADER] = {direction, marks, 0, 0};
+    static const unsigned char zeros[4] = {0};
+
+    uint32_t block[7] = {BLOCK_EPB, length, lane, ns >> 32, (uint32_t)ns, captured, captured};
+    fwrite(block, 4, 7, f);
+    fwrite(header, 1, CAPTURE_HEADER, f);
+    fwrite(data, 1, n, f);
+    fwrite(zeros, 1, pad(captured), f);
+    putOption(f, OPT_EPB_FLAGS, &flags, 4);
+    putOption(f, OPT_END, NULL, 0);
+    put32(f, length);
+
+    c->packets++;
+    c->bytes += n;
+}
+
+void captureFlush(Capture *c)
+{
+    if (c->file != NULL)
+        fflush(c->file);
+}
+
+void captureClose(Capture *c)
+{
+    if (c->file != NULL)
+        fclose(c->file);
+    c->file = NULL;
+}
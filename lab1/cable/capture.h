@@ -0,0 +1,40 @@
+// Wire capture of the virtual cable, in pcapng.
+// Every chunk the cable writes to a port, and every chunk an impairment or
+// the cable being off kept from it, is one packet with a nanosecond time
+// stamp. Each lane is an interface with the link type CAPTURE_LINKTYPE
+// (LINKTYPE_USER0). A packet's data is a CAPTURE_HEADER byte header, then
+// the bytes as they were on the line:
+//   byte 0   direction: 0 Tx>Rx, 1 Rx>Tx
+//   byte 1   what was done to the bytes (MARK_* flags, see impair.h)
+//   byte 2-3 zero
+// The direction is also in the epb_flags option (Tx>Rx outbound, Rx>Tx
+// inbound). tools/capture_decode.c prints the frames of a capture.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+
+#define CAPTURE_LINKTYPE 147   // LINKTYPE_USER0
+#define CAPTURE_HEADER 4
+
+typedef struct
+{
+    FILE *file;
+    long long packets;
+    long long bytes;
+} Capture;
+
+// Create path and write the section header and one interface per lane.
+// Return "0" on success or "-1".
+int captureOpen(Capture *c, const char *path, int lanes);
+
+// Record n bytes of a lane's direction (0 Tx>Rx, 1 Rx>Tx), stamped now.
+void captureChunk(Capture *c, int lane, int direction, int marks, const unsigned char *data, int n);
+
+// Write out what is buffered.
+void captureFlush(Capture *c);
+
+void captureClose(Capture *c);
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,497 @@
+// Channel impairments of the virtual cable.
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "impair.h"
+
+#define FALSE 0
+#define TRUE 1
+#define FLAG 0x7E
+
+// splitmix64: small, fast and the same everywhere
+static uint64_t nextRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double uniform(uint64_t *state)
+{
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void seedDirection(Impairment *im, uint64_t seed, int index)
+{
+    uint64_t s = seed * 4 + index * 2;
+    im->bitRng = nextRandom(&s);
+    im->frameRng = nextRandom(&s);
+}
+
+void impairInit(Impairment *dir, int lanes)
+{
+    for (int d = 0; d < 2 * lanes; d++)
+    {
+        memset(&dir[d], 0, sizeof(dir[d]));
+        seedDirection(&dir[d], 1, d);
+    }
+}
+
+static int probability(double p)
+{
+    return p >= 0 && p <= 1;
+}
+
+static int applySetting(Impairment *im, int index, const char *name, const char *args)
+{
+    if (strcmp(name, "seed") == 0)
+    {
+        unsigned long long seed;
+        if (sscanf(args, "%llu", &seed) != 1)
+            return -1;
+        seedDirection(im, seed, index);
+    }
+    else if (strcmp(name, "ber") == 0)
+    {
+        if (sscanf(args, "%lf", &im->ber) != 1 || !probability(im->ber))
+            return -1;
+    }
+    else if (strcmp(name, "burst") == 0)
+    {
+        if (sscanf(args, "%lf %lf %lf", &im->pGoodBad, &im->pBadGood, &im->berBad) != 3 ||
+            !probability(im->pGoodBad) || !probability(im->pBadGood) || !probability(im->berBad))
+            return -1;
+    }
+    else if (strcmp(name, "drop") == 0)
+    {
+        if (sscanf(args, "%lf", &im->drop) != 1 || !probability(im->drop))
+            return -1;
+    }
+    else if (strcmp(name, "dup") == 0)
+    {
+        if (sscanf(args, "%lf", &im->dup) != 1 || !probability(im->dup))
+            return -1;
+    }
+    else if (strcmp(name, "delay") == 0)
+    {
+        if (sscanf(args, "%lf %d", &im->delay, &im->delayMs) != 2 || !probability(im->delay) || im->delayMs < 0)
+            return -1;
+    }
+    else if (strcmp(name, "rate") == 0)
+    {
+        if (sscanf(args, "%d", &im->rate) != 1 || im->rate < 0)
+            return -1;
+    }
+    else if (strcmp(name, "latency") == 0)
+    {
+        if (sscanf(args, "%d", &im->latencyMs) != 1 || im->latencyMs < 0)
+            return -1;
+    }
+    else if (strcmp(name, "off") == 0)
+    {
+        if (im->offWindows == MAX_OFF_WINDOWS)
+            return -1;
+        long long *start = &im->offStart[im->offWindows], *length = &im->offLength[im->offWindows];
+        if (sscanf(args, "%lld %lld", start, length) != 2 || *start < 0 || *length <= 0)
+            return -1;
+        im->offWindows++;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+int impairParse(Impairment *dir, int lanes, const char *line)
+{
+    char word[32];
+    int used = 0;
+
+    while (isspace((unsigned char)*line))
+        line++;
+    if (*line == '\0' || *line == '#')
+        return 0;
+
+    int firstLane = 0, lastLane = lanes - 1;
+    if (sscanf(line, "%31s%n", word, &used) != 1)
+        return -1;
+    if (strcmp(word, "lane") == 0)
+    {
+        line += used;
+        if (sscanf(line, "%d%n", &firstLane, &used) != 1 || firstLane < 0 || firstLane >= lanes)
+            return -1;
+        lastLane = firstLane;
+        line += used;
+        if (sscanf(line, "%31s%n", word, &used) != 1)
+            return -1;
+    }
+
+    int from = 0, to = 2;
+    if (strcmp(word, "tx>rx") == 0 || strcmp(word, "rx>tx") == 0)
+    {
+        from = word[0] == 'r';
+        to = from + 1;
+        line += used;
+        if (sscanf(line, "%31s%n", word, &used) != 1)
+            return -1;
+    }
+    line += used;
+
+    for (int lane = firstLane; lane <= lastLane; lane++)
+        for (int d = from; d < to; d++)
+            if (applySetting(&dir[2 * lane + d], 2 * lane + d, word, line) < 0)
+                return -1;
+    return 0;
+}
+
+int impairLoad(Impairment *dir, int lanes, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int number = 0, result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        if (impairParse(dir, lanes, line) < 0)
+        {
+            printf("%s:%d: bad impairment \"%s\"\n", path, number, strtok(line, "\r\n"));
+            result = -1;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+void impairPrint(const Impairment *im, const char *name)
+{
+    if (im->ber == 0 && im->pGoodBad == 0 && im->drop == 0 && im->dup == 0 && im->delay == 0 && im->offWindows == 0 &&
+        im->rate == 0 && im->latencyMs == 0)
+        return;
+
+    printf("Impairments %s:", name);
+    if (im->ber > 0)
+        printf(" ber %g", im->ber);
+    if (im->pGoodBad > 0)
+        printf(" burst %g/%g at ber %g", im->pGoodBad, im->pBadGood, im->berBad);
+    if (im->drop > 0)
+        printf(" drop %g", im->drop);
+    if (im->dup > 0)
+        printf(" dup %g", im->dup);
+    if (im->delay > 0)
+        printf(" delay %g x %d ms", im->delay, im->delayMs);
+    for (int i = 0; i < im->offWindows; i++)
+        printf(" off %lld+%lld ms", im->offStart[i], im->offLength[i]);
+    if (im->rate > 0)
+        printf(" rate %d bit/s", im->rate);
+    if (im->latencyMs > 0)
+        printf(" latency %d ms", im->latencyMs);
+    printf("\n");
+}
+
+static void queueAppend(Queue *out, const unsigned char *buf, int n, long long due, int marks)
+{
+    Chunk *c = malloc(sizeof(Chunk) + n);
+    c->due = due;
+    c->size = n;
+    c->marks = marks;
+    c->next = NULL;
+    memcpy(c->data, buf, n);
+    if (out->tail == NULL)
+        out->head = c;
+    else
+        out->tail->next = c;
+    out->tail = c;
+    out->bytes += n;
+}
+
+// Milliseconds n bytes keep the line busy
+static double lineTime(const Queue *out, int n)
+{
+    return out->bitRate > 0 ? n * BITS_PER_BYTE * 1000.0 / out->bitRate : 0;
+}
+
+// Send n bytes ready at time due. On a paced line they go out after what is
+// already on it, in slices, each due when its last byte arrives.
+static void queuePush(Queue *out, const unsigned char *buf, int n, long long due, int marks)
+{
+    if (n <= 0)
+        return;
+    if (out->bitRate <= 0 && out->latencyMs == 0)
+    {
+        queueAppend(out, buf, n, due, marks);
+        return;
+    }
+
+    double sent = due > out->lineFree ? due : out->lineFree;
+    int slice = n;
+    if (out->bitRate > 0 && lineTime(out, n) > SLICE_MS)
+        slice = SLICE_MS / lineTime(out, 1) + 1;
+    for (int i = 0; i < n; i += slice)
+    {
+        int size = n - i < slice ? n - i : slice;
+        sent += lineTime(out, size);
+        queueAppend(out, buf + i, size, (long long)ceil(sent) + out->latencyMs, marks);
+    }
+    out->lineFree = sent;
+}
+
+// A frame lost on the way still took its time on the line
+static void queueWaste(Queue *out, int n, long long due)
+{
+    if (out->bitRate <= 0)
+        return;
+    double sent = due > out->lineFree ? due : out->lineFree;
+    out->lineFree = sent + lineTime(out, n);
+}
+
+void queueSetLine(Queue *out, const Impairment *im)
+{
+    out->bitRate = im->rate;
+    out->latencyMs = im->latencyMs;
+}
+
+void queueLost(Queue *out, const unsigned char *buf, int n, int marks)
+{
+    if (out->capture != NULL && n > 0)
+        captureChunk(out->capture, out->lane, out->direction, marks, buf, n);
+}
+
+long long queueDue(const Queue *out)
+{
+    return out->head == NULL ? -1 : out->head->due;
+}
+
+// Write n bytes to a port, after what it holds already; what it does not
+// take is kept, up to OUTLET_LIMIT bytes.
+static void outletWrite(Outlet *o, const unsigned char *buf, int n)
+{
+    if (o->size == 0)
+    {
+        int written = write(o->fd, buf, n);
+        if (written < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            o->dropped += n;
+            return;
+        }
+        if (written > 0)
+        {
+            buf += written;
+            n -= written;
+        }
+    }
+    if (n == 0)
+        return;
+
+    if (n > OUTLET_LIMIT - o->size)
+    {
+        o->dropped += n - (OUTLET_LIMIT - o->size);
+        n = OUTLET_LIMIT - o->size;
+    }
+    if (o->size + n > o->capacity)
+    {
+        int capacity = o->capacity > 0 ? o->capacity : 4096;
+        while (capacity < o->size + n)
+            capacity *= 2;
+        unsigned char *data = realloc(o->data, capacity);
+        if (data == NULL)
+        {
+            o->dropped += n;
+            return;
+        }
+        o->data = data;
+        o->capacity = capacity;
+    }
+    memcpy(o->data + o->size, buf, n);
+    o->size += n;
+}
+
+int outletFlush(Outlet *o)
+{
+    if (o->size == 0)
+        return 0;
+
+    int written = write(o->fd, o->data, o->size);
+    if (written < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            o->dropped += o->size;
+            o->size = 0;
+        }
+        return 0;
+    }
+    memmove(o->data, o->data + written, o->size - written);
+    o->size -= written;
+    return written;
+}
+
+int queueFlush(Queue *out, long long now, Outlet *outs, int n)
+{
+    int written = 0;
+
+    // First in, first out, like a line: a delayed frame holds back the ones after it
+    while (out->head != NULL && out->head->due <= now)
+    {
+        Chunk *c = out->head;
+        for (int i = 0; i < n; i++)
+            outletWrite(&outs[i], c->data, c->size);
+        if (out->capture != NULL)
+            captureChunk(out->capture, out->lane, out->direction, c->marks, c->data, c->size);
+        written += c->size;
+        out->bytes -= c->size;
+        out->head = c->next;
+        if (out->head == NULL)
+            out->tail = NULL;
+        free(c);
+    }
+    return written;
+}
+
+static int disconnected(const Impairment *im, long long elapsed)
+{
+    for (int i = 0; i < im->offWindows; i++)
+        if (elapsed >= im->offStart[i] && elapsed < im->offStart[i] + im->offLength[i])
+            return TRUE;
+    return FALSE;
+}
+
+// Flip bits of buf: one draw per byte for the Gilbert-Elliott state and one
+// for an error, so the errors depend on the position in the stream only.
+// Return the number of bytes hit.
+static int addBitErrors(Impairment *im, unsigned char *buf, int n)
+{
+    long long before = im->done.bitErrors;
+    double byteError[2] = {1 - pow(1 - im->ber, 8), 1 - pow(1 - im->berBad, 8)};
+    int bursts = im->pGoodBad > 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (bursts)
+            im->bad = uniform(&im->bitRng) < (im->bad ? 1 - im->pBadGood : im->pGoodBad);
+        if (uniform(&im->bitRng) < byteError[im->bad])
+        {
+            buf[i] ^= 1 << (nextRandom(&im->bitRng) % 8);
+            im->done.bitErrors++;
+        }
+    }
+    return im->done.bitErrors - before;
+}
+
+// Drop, duplicate or delay a complete frame
+static void passFrame(Impairment *im, long long now, Queue *out)
+{
+    // Every frame takes three draws, whatever the settings, to keep the streams aligned
+    int drop = uniform(&im->frameRng) < im->drop;
+    int dup = uniform(&im->frameRng) < im->dup;
+    int delay = uniform(&im->frameRng) < im->delay;
+
+    int marks = im->frameMarks;
+    if (drop)
+    {
+        queueWaste(out, im->frameSize, now);
+        queueLost(out, im->frame, im->frameSize, marks | MARK_DROPPED);
+        im->done.dropped++;
+    }
+    else
+    {
+        long long due = now;
+        if (delay)
+        {
+            due += im->delayMs;
+            marks |= MARK_DELAYED;
+            im->done.delayed++;
+        }
+        queuePush(out, im->frame, im->frameSize, due, marks);
+        if (dup)
+        {
+            queuePush(out, im->frame, im->frameSize, due, marks | MARK_DUPLICATE);
+            im->done.duplicated++;
+        }
+    }
+    im->frameSize = 0;
+    im->frameMarks = 0;
+}
+
+void impairFeed(Impairment *im, const unsigned char *buf, int n, int marks, long long now, long long start, Queue *out)
+{
+    static unsigned char copy[IMPAIR_FRAME_SIZE];
+
+    if (disconnected(im, now - start))
+    {
+        // The frame it was in is lost too
+        im->done.cut += n + im->frameSize;
+        queueLost(out, im->frame, im->frameSize, im->frameMarks | MARK_CUT);
+        queueLost(out, buf, n, marks | MARK_CUT);
+        im->frameSize = 0;
+        im->frameMarks = 0;
+        im->inFrame = FALSE;
+        return;
+    }
+
+    while (n > 0)
+    {
+        int size = n < (int)sizeof(copy) ? n : (int)sizeof(copy);
+        memcpy(copy, buf, size);
+        buf += size;
+        n -= size;
+        int copyMarks = marks;
+        if ((im->ber > 0 || im->pGoodBad > 0) && addBitErrors(im, copy, size) > 0)
+            copyMarks |= MARK_BIT_ERRORS;
+
+        if (im->drop == 0 && im->dup == 0 && im->delay == 0)
+        {
+            queuePush(out, copy, size, now, copyMarks);
+            continue;
+        }
+
+        // Frames are held until their closing FLAG; bytes between frames go straight through
+        int from = 0;
+        for (int i = 0; i < size; i++)
+        {
+            if (!im->inFrame && copy[i] != FLAG)
+                continue;
+            queuePush(out, copy + from, i - from, now, copyMarks);
+            from = i + 1;
+
+            // A FLAG right after the opening one: that one was the closing FLAG of a frame
+            // whose opening FLAG a bit error hid (or a bit error made a FLAG). As in the link
+            // layer's decoder, it goes through on its own and this one opens the frame.
+            if (copy[i] == FLAG && im->inFrame && im->frameSize == 1)
+            {
+                queuePush(out, im->frame, 1, now, im->frameMarks);
+                im->frameSize = 0;
+                im->frameMarks = 0;
+                im->inFrame = FALSE;
+            }
+
+            im->frame[im->frameSize++] = copy[i];
+            im->frameMarks |= copyMarks;
+            if (copy[i] == FLAG)
+                im->inFrame = !im->inFrame;
+            if (!im->inFrame)
+                passFrame(im, now, out);
+            else if (im->frameSize == IMPAIR_FRAME_SIZE)
+            {
+                // No closing FLAG in sight: let it through as it is
+                queuePush(out, im->frame, im->frameSize, now, im->frameMarks);
+                im->frameSize = 0;
+                im->frameMarks = 0;
+                im->inFrame = FALSE;
+            }
+        }
+        queuePush(out, copy + from, size - from, now, copyMarks);
+    }
+}
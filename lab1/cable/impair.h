@@ -0,0 +1,152 @@
+// Channel impairments of the virtual cable.
+// Each direction of the cable has its own seeded model, so a run with the
+// same settings and the same bytes gets the same errors:
+// - Bit errors: a bit error rate, optionally with Gilbert-Elliott bursts (a
+//   good and a bad state, each with its own rate, switching byte by byte).
+// - Frame drops, duplicates and delays, decided frame by frame (frames are
+//   told apart by their FLAGs).
+// - Disconnections: windows of time, from the start of the cable, in which
+//   nothing gets through.
+// - A line rate and a propagation delay: bytes leave one after the other at
+//   the rate (10 bits a byte, 8N1) and arrive the delay later.
+// Settings are lines such as "ber 1e-5" or "lane 2 rx>tx drop 0.05", given
+// with -i or read from a script file with -f (see impairParse).
+
+#ifndef _IMPAIR_H_
+#define _IMPAIR_H_
+
+#include <stdint.h>
+
+#include "capture.h"
+
+#define MAX_OFF_WINDOWS 16
+#define IMPAIR_FRAME_SIZE 65536     // Longest frame held back to be dropped, duplicated or delayed
+#define BITS_PER_BYTE 10            // Start bit, 8 data bits, stop bit
+#define SLICE_MS 5                  // A paced line hands bytes over this often
+#define OUTLET_LIMIT (1 << 20)      // Bytes held for a port that does not take them, then dropped
+
+// What was done to the bytes of a chunk, as recorded in a capture
+#define MARK_NOISE 0x01      // Interactive noise
+#define MARK_BIT_ERRORS 0x02 // Bit errors in some of the bytes
+#define MARK_DUPLICATE 0x04  // Second copy of a frame
+#define MARK_DELAYED 0x08    // Frame held back
+#define MARK_DROPPED 0x10    // Lost: frame dropped
+#define MARK_CUT 0x20        // Lost: disconnection
+#define MARK_OFF 0x40        // Lost: the cable was off
+
+// Bytes waiting to go out, in the order they were read
+typedef struct Chunk
+{
+    long long due; // Time (ms) it can be written
+    int size;
+    int marks;     // MARK_* flags
+    struct Chunk *next;
+    unsigned char data[];
+} Chunk;
+
+// Bytes on their way in one direction. With a rate or a propagation delay the
+// queue is the line itself: each chunk is due when its last byte arrives.
+typedef struct
+{
+    Chunk *head, *tail;
+    long long bytes;
+    int bitRate;        // Bits per second, 0 for no pacing
+    int latencyMs;      // Propagation delay
+    double lineFree;    // Time (ms) the line finishes sending what it has
+    Capture *capture;   // Where chunks are recorded, or NULL
+    int lane, direction;
+} Queue;
+
+// Bytes written to a port that it did not take yet. The masters are
+// non-blocking, so a program that stops reading holds up its own port only.
+typedef struct
+{
+    int fd;
+    unsigned char *data;
+    int size, capacity;
+    long long dropped;  // Bytes past OUTLET_LIMIT, or that the port refused
+} Outlet;
+
+// What the impairments did to a direction
+typedef struct
+{
+    long long bitErrors;  // Bytes hit by bit errors
+    long long dropped;    // Frames
+    long long duplicated; // Frames
+    long long delayed;    // Frames
+    long long cut;        // Bytes lost to a disconnection
+} ImpairCounts;
+
+typedef struct
+{
+    // Settings
+    double ber;                  // Bit error rate (good state)
+    double pGoodBad, pBadGood;   // Gilbert-Elliott: chance per byte of entering / leaving the bad state
+    double berBad;               // Bit error rate in the bad state
+    double drop, dup, delay;     // Chance per frame of being dropped, sent twice, delayed
+    int delayMs;                 // Delay of a delayed frame
+    int rate;                    // Line rate in bits per second, 0 for none
+    int latencyMs;               // Propagation delay
+    long long offStart[MAX_OFF_WINDOWS], offLength[MAX_OFF_WINDOWS];
+    int offWindows;
+
+    // State
+    uint64_t bitRng, frameRng;   // Separate streams: bit errors don't shift the frame decisions
+    int bad;                     // Gilbert-Elliott state
+    unsigned char frame[IMPAIR_FRAME_SIZE];
+    int frameSize;
+    int inFrame;
+    int frameMarks;              // MARK_* flags of the bytes of frame
+
+    ImpairCounts done;
+} Impairment;
+
+// Reset both directions of every lane to a clean cable. Lane k's Tx>Rx
+// direction is dir[2 * k], its Rx>Tx direction dir[2 * k + 1].
+void impairInit(Impairment *dir, int lanes);
+
+// Apply one setting line. It may start with "lane K" to set lane K only, then
+// with a direction ("tx>rx" or "rx>tx"); otherwise the setting is for every
+// lane and both directions. Settings:
+//   seed N                     seed of every random choice (default 1)
+//   ber R                      bit error rate
+//   burst P_GB P_BG R          Gilbert-Elliott bursts: per byte chance of going bad and of
+//                              going back to good, and the bit error rate while bad
+//   drop P | dup P             chance per frame of being lost / sent twice
+//   delay P MS                 chance per frame of being held back MS milliseconds
+//   off START_MS LENGTH_MS     disconnect at START_MS after the cable starts, for LENGTH_MS
+//   rate BPS                   pace the line to BPS bits per second
+//   latency MS                 one-way propagation delay
+// Blank lines and lines starting with '#' are ignored.
+// Return "0" on success or "-1" on an unknown or malformed setting.
+int impairParse(Impairment *dir, int lanes, const char *line);
+
+// Apply every line of a script file. Return "0" on success or "-1" (the
+// error names the line).
+int impairLoad(Impairment *dir, int lanes, const char *path);
+
+// Print the settings of a direction, if it has any.
+void impairPrint(const Impairment *im, const char *name);
+
+// Pass n bytes read at time now through the impairments of a direction.
+// marks is what was already done to them. What gets through is added to out.
+void impairFeed(Impairment *im, const unsigned char *buf, int n, int marks, long long now, long long start, Queue *out);
+
+// Take the rate and propagation delay of a direction into its queue.
+void queueSetLine(Queue *out, const Impairment *im);
+
+// Record n bytes that will never be written, if out is captured.
+void queueLost(Queue *out, const unsigned char *buf, int n, int marks);
+
+// Time (ms) the first chunk of out can be written, or "-1" when it is empty.
+long long queueDue(const Queue *out);
+
+// Hand the chunks of out that are due to the n outlets in outs, and record
+// them if out is captured. Return the number of bytes handed to each outlet.
+int queueFlush(Queue *out, long long now, Outlet *outs, int n);
+
+// Write what an outlet holds, as far as its port takes it (poll it for
+// POLLOUT while size > 0). Return the number of bytes written.
+int outletFlush(Outlet *o);
+
+#endif // _IMPAIR_H_
@@ -0,0 +1,52 @@
+// Content-defined chunking and the chunk store.
+// Files are cut into chunks where a gear rolling hash of the content hits a
+// mask (FastCDC style), so an edit only changes the chunks around it. Chunks
+// are kept in a directory, one file per chunk named after its 128-bit hash.
+// Both sides cut the same byte stream the same way, so a chunk the transmitter
+// has sent before is one the receiver has stored.
+
+#ifndef _CHUNK_STORE_H_
+#define _CHUNK_STORE_H_
+
+#include <stdint.h>
+
+#define CDC_MIN         2048    // No cut before this many bytes
+#define CDC_AVG         8192    // Target chunk size
+#define CDC_MAX         65536   // Forced cut
+#define KEY_SIZE        16      // Bytes per key in a CTRL_ASK packet: hi (8) + lo (8)
+
+typedef struct {
+    uint64_t hi, lo;
+} ChunkKey;
+
+typedef struct {
+    uint64_t fp;        // Gear hash of the bytes scanned so far
+    int pos;            // Bytes of the current chunk already scanned
+} Chunker;
+
+// Start a new chunk.
+void chunkerInit(Chunker *chunker);
+
+// Continue scanning the current chunk, whose first len bytes are in buf (the
+// bytes before chunker->pos were scanned by earlier calls).
+// Return the chunk size once a cut is found (the chunker then starts a new
+// chunk), or "0" when more bytes are needed. The last chunk of a stream ends
+// wherever the stream does.
+int chunkerScan(Chunker *chunker, const unsigned char *buf, int len);
+
+ChunkKey chunkKey(const unsigned char *data, int len);
+
+// Use dir as the store, creating it if needed.
+// Return "0" on success or "-1" on error.
+int storeOpen(const char *dir);
+
+// Return "1" when the chunk is in the store, "0" otherwise.
+int storeHas(ChunkKey key);
+
+// Add a chunk. Return "0" on success or "-1" on error.
+int storePut(ChunkKey key, const unsigned char *data, int len);
+
+// Read a chunk of len bytes into data. Return "0" on success or "-1" when it is missing.
+int storeGet(ChunkKey key, unsigned char *data, int len);
+
+#endif // _CHUNK_STORE_H_
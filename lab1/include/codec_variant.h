@@ -0,0 +1,145 @@
+// One frame codec variant, expanded by frame_decoder.c once per frame check.
+// Before including this file define CODEC_CHECK, the frame check as a number
+// the preprocessor can test (0 XOR, 1 CRC-16, 2 CRC-32, 3 CRC-32C, as in
+// FCS_TYPE), and CODEC_NAME(f), the name of this variant's function f.
+// Nothing in the generated functions looks at the frame check at run time.
+//
+// No include guard: the file is meant to be included more than once.
+
+#if CODEC_CHECK == 0
+#define CHECK_SIZE 1
+#elif CODEC_CHECK == 1
+#define CHECK_SIZE 2
+#else
+#define CHECK_SIZE 4
+#endif
+
+// Frame check of n payload bytes, least significant byte first
+static void CODEC_NAME(check)(const unsigned char *p, int n, unsigned char *out){
+#if CODEC_CHECK == 0
+    out[0] = xorCheck(p, n);
+#elif CODEC_CHECK == 1
+    uint16_t crc = crc16(p, n);
+    out[0] = crc;
+    out[1] = crc >> 8;
+#else
+#if CODEC_CHECK == 2
+    uint32_t crc = crc32(p, n);
+#else
+    uint32_t crc = crc32c(p, n);
+#endif
+    out[0] = crc;
+    out[1] = crc >> 8;
+    out[2] = crc >> 16;
+    out[3] = crc >> 24;
+#endif
+}
+
+// Stuff the frame check and close the frame
+static int CODEC_NAME(encodeTrailer)(const unsigned char *check, unsigned char *out, int pos){
+    for(int i = 0; i < CHECK_SIZE; i++) pos += stuffByte(check[i], out + pos);
+    out[pos++] = FLAG;
+    return pos;
+}
+
+// Small payloads: a byte at a time through the escape table
+static int CODEC_NAME(encodeSmall)(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out){
+    unsigned char check[CHECK_SIZE];
+    CODEC_NAME(check)(payload, size, check);
+
+    int pos = encodeHeader(A, C, out);
+    for(int i = 0; i < size; i++){
+        unsigned char e = escapeOf[payload[i]];
+        if(e){
+            out[pos++] = ESC_B1;
+            out[pos++] = e;
+        }
+        else out[pos++] = payload[i];
+    }
+    return CODEC_NAME(encodeTrailer)(check, out, pos);
+}
+
+// Large payloads: escape-free runs are found a block at a time and copied whole
+static int CODEC_NAME(encodeBulk)(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out){
+    unsigned char check[CHECK_SIZE];
+    CODEC_NAME(check)(payload, size, check);
+
+    int pos = encodeHeader(A, C, out);
+    int i = 0;
+    while(i < size){
+        int run = escapeFreeRun(payload + i, size - i);
+        memcpy(out + pos, payload + i, run);
+        pos += run;
+        i += run;
+        if(i < size) pos += stuffByte(payload[i++], out + pos);
+    }
+    return CODEC_NAME(encodeTrailer)(check, out, pos);
+}
+
+// Length-prefixed frame: the payload and the frame check go out as they are
+static int CODEC_NAME(encodeRaw)(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out){
+    int pos = encodeRawHeader(A, C, size, out);
+    memcpy(out + pos, payload, size);
+    CODEC_NAME(check)(payload, size, out + pos + size);
+    pos += size + CHECK_SIZE;
+    out[pos++] = FLAG;
+    return pos;
+}
+
+// Copy n payload bytes. Past capacity only the frame check may follow.
+static void CODEC_NAME(copyRun)(FrameDecoder *d, const unsigned char *src, int n){
+    int room = d->capacity - d->size;
+    int copy = n < room ? n : room;
+    unsigned char *dst = d->payload + d->size;
+    int i = 0;
+
+#if CODEC_CHECK == 0
+    // BCC2 folded into the copy, 8 bytes at a time
+    uint64_t acc = 0;
+    for(; i + 8 <= copy; i += 8){
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        memcpy(dst + i, &w, 8);
+        acc ^= w;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    unsigned char bcc = d->bcc2 ^ (unsigned char) acc;
+    for(; i < copy; i++){
+        dst[i] = src[i];
+        bcc ^= src[i];
+    }
+    for(int j = i; j < n; j++) bcc ^= src[j];
+    d->bcc2 = bcc;
+#else
+    // The CRC is computed once the frame ends
+    memcpy(dst, src, copy);
+    i = copy;
+#endif
+    d->size += copy;
+
+    for(; i < n; i++){
+        if(d->spill == CHECK_SIZE) d->bad = TRUE;
+        else d->spillBytes[d->spill++] = src[i];
+    }
+}
+
+// Whether the "total" bytes of a finished frame end in a good frame check
+static int CODEC_NAME(checkFrame)(const FrameDecoder *d, int total){
+#if CODEC_CHECK == 0
+    // BCC2 is the last payload byte, so the XOR of everything is 0 on a good frame
+    (void) total;
+    return d->bcc2 == 0;
+#else
+    unsigned char expected[CHECK_SIZE];
+    CODEC_NAME(check)(d->payload, total - CHECK_SIZE, expected);
+    int diff = 0;
+    for(int i = 0; i < CHECK_SIZE; i++) diff |= frameByte(d, total - CHECK_SIZE + i) ^ expected[i];
+    return diff == 0;
+#endif
+}
+
+#undef CHECK_SIZE
+#undef CODEC_CHECK
+#undef CODEC_NAME
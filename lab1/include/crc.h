@@ -0,0 +1,47 @@
+// Frame check sequences.
+// The BCC2 of an information frame is a plain XOR by default. A stronger
+// check can be negotiated at llopen: CRC-16/X-25 (the HDLC FCS), CRC-32
+// (IEEE) or CRC-32C (Castagnoli). The CRCs are table driven, eight bytes at
+// a time (slicing-by-8); CRC-32C uses the SSE4.2 crc32 instruction when the
+// CPU has it.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    FCS_XOR,        // 1 byte, the original BCC2
+    FCS_CRC16,      // 2 bytes
+    FCS_CRC32,      // 4 bytes
+    FCS_CRC32C,     // 4 bytes
+} FCS_TYPE;
+
+#define FCS_TYPES       4
+#define FCS_MAX_SIZE    4
+
+// Bytes the check takes at the end of the frame.
+int fcsSize(FCS_TYPE type);
+
+// Name of the check ("xor", "crc16", "crc32", "crc32c"), and the reverse.
+// fcsType returns "-1" for an unknown name.
+const char *fcsName(FCS_TYPE type);
+int fcsType(const char *name);
+
+// Check of len bytes, written to out least significant byte first.
+void fcsCompute(FCS_TYPE type, const unsigned char *buf, int len, unsigned char *out);
+
+// The checks on their own (complete: initial value and final XOR applied).
+uint8_t xorCheck(const unsigned char *buf, size_t len);
+uint16_t crc16(const unsigned char *buf, size_t len);
+uint32_t crc32(const unsigned char *buf, size_t len);
+uint32_t crc32c(const unsigned char *buf, size_t len);
+
+// CRC-32C without the hardware path, for comparison.
+uint32_t crc32cTable(const unsigned char *buf, size_t len);
+
+// Return "1" when crc32c runs on the SSE4.2 instruction.
+int crc32cHardware();
+
+#endif // _CRC_H_
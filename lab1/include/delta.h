@@ -0,0 +1,81 @@
+// Block-signature delta encoding (rsync style).
+// The receiver describes the file it already has as a list of block signatures:
+// a rolling checksum, cheap to slide one byte at a time, and a strong hash to
+// confirm a match. The transmitter slides a window over the new file and turns
+// it into literal runs and references to the receiver's blocks. The new file is
+// read as the window moves, through a buffer of DELTA_BUFFER bytes, so its size
+// is not bounded by memory.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 16384
+#define DELTA_MAX_BLOCKS (1L << 24) // Signatures taken from the receiver, 256 GiB of blocks at most
+#define SIG_SIZE        12      // Bytes per signature in a CTRL_SIGS packet: weak (4) + strong (8)
+#define DELTA_BUFFER    (1 << 18) // Bytes of the new file held at once, several blocks
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} BlockSig;
+
+typedef enum {
+    DELTA_LITERAL,      // Send bytes [offset, offset + length) of the new file
+    DELTA_COPY,         // Copy "count" blocks of the old file from block "block" on
+} DELTA_OP;
+
+typedef struct {
+    DELTA_OP type;
+    long offset, length;
+    long block, count;
+} DeltaOp;
+
+typedef struct {
+    int fd;                     // New file
+    long size;
+    unsigned char *buffer;      // bufferLen bytes of it from bufferStart on
+    long bufferStart, bufferLen;
+    int blockSize;
+    const BlockSig *sigs;       // Blocks of the old file
+    long blocks;
+    long *table;                // Open addressing on the weak checksum: block index + 1, 0 when empty
+    long tableMask;
+    long pos;                   // Start of the window
+    long literal;               // Start of the literal run not handed out yet
+    uint32_t weak;              // Rolling checksum of the window
+    int weakValid;
+} DeltaScan;
+
+// Block size for an old file of the given size: about its square root.
+int deltaBlockSize(long fileSize);
+
+// Rolling checksum of len bytes.
+uint32_t weakChecksum(const unsigned char *buf, int len);
+
+// Signature of one block.
+BlockSig blockSignature(const unsigned char *block, int len);
+
+// Prepare to encode the size bytes of fd against the given signatures.
+// Return "0" on success or "-1" on error.
+int deltaInit(DeltaScan *scan, int fd, long size, int blockSize, const BlockSig *sigs, long blocks);
+
+// Next operation, with literal runs of at most maxLiteral bytes.
+// Return "1" when op was filled, "0" when the whole file was covered or "-1"
+// when it could not be read.
+int deltaNext(DeltaScan *scan, long maxLiteral, DeltaOp *op);
+
+// Bytes of the new file from offset on, for the range of the operation
+// deltaNext just returned. Valid until the next call to deltaNext.
+const unsigned char *deltaData(const DeltaScan *scan, long offset);
+
+// Free what deltaInit allocated; a zeroed scan is left alone.
+void deltaFree(DeltaScan *scan);
+
+// Big-endian fields of the delta packets.
+void putBE(unsigned char *p, uint64_t value, int bytes);
+uint64_t getBE(const unsigned char *p, int bytes);
+
+#endif // _DELTA_H_
@@ -0,0 +1,104 @@
+// Frame codec.
+// Builds I frames for sending, and a single decoder for I, S and U frames.
+// The decoder runs the header through a transition table; I frame payloads are
+// searched for FLAG/ESC_B1 a block at a time, and escape-free runs are copied
+// in bulk with BCC2 folded into the copy. With a CRC frame check the trailing
+// check bytes are verified once the frame ends.
+//
+// The payload code is generated once per frame check (codec_variant.h), so the
+// loops never test which check is in use. llopen picks the variant once the
+// check is agreed.
+//
+// On 8-bit clean links llopen can also agree on length-prefixed I frames,
+// which need no stuffing: FLAG A C, the payload length (2 bytes, least
+// significant first), a CRC-16 of A, C and the length (2 bytes), then the
+// payload and the frame check as they are, FLAG. S and U frames never need
+// stuffing and keep their format.
+
+#ifndef _FRAME_DECODER_H_
+#define _FRAME_DECODER_H_
+
+#include "crc.h"
+#include "utils.h"
+
+// Largest frame built from a payload of "size" bytes: every byte stuffed
+#define FRAME_MAX(size) (2 * ((size) + FCS_MAX_SIZE) + 5)
+
+// Bytes of a length-prefixed header between C and the payload: length and header check
+#define RAW_HEADER_SIZE 4
+
+typedef enum {
+    FRAME_NONE,     // No complete frame yet
+    FRAME_I,        // Information frame with a valid BCC2
+    FRAME_S,        // Supervision / unnumbered frame
+    FRAME_BAD,      // Information frame with a valid header but a bad BCC2/CRC, stuffing or size
+} FRAME_KIND;
+
+typedef struct {
+    FRAME_KIND kind;
+    unsigned char a, c;
+    unsigned char credit;   // RR frames with the CREDIT bit, or the options of SET/UA with the OPTIONS bit
+    int size;               // Payload bytes of an I frame (frame check removed)
+} Frame;
+
+typedef struct FrameDecoder FrameDecoder;
+
+// Payloads up to this size are stuffed a byte at a time, larger ones by runs
+#define SMALL_PAYLOAD 8
+
+// The codec of one frame check and framing
+typedef struct {
+    FCS_TYPE fcs;
+    int checkSize;      // Bytes of the frame check
+    int raw;            // Length-prefixed I frames, no stuffing
+    int (*encodeSmall)(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out);
+    int (*encodeBulk)(unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out);
+    void (*copyRun)(FrameDecoder *d, const unsigned char *src, int n);
+    int (*checkFrame)(const FrameDecoder *d, int total);
+} FrameCodec;
+
+struct FrameDecoder {
+    STATE state;
+    unsigned char a, c, credit;
+    unsigned char bcc2;         // XOR of every payload byte so far, BCC2 included
+    const FrameCodec *codec;    // Frame check in use
+    unsigned char *payload;
+    int capacity;
+    int size;                   // Payload bytes stored, frame check included once the frame ends
+    int spill;                  // Bytes past capacity: allowed up to the size of the frame check
+    unsigned char spillBytes[FCS_MAX_SIZE];
+    int bad;                    // Stuffing error or overflow seen in this frame
+    unsigned char header[RAW_HEADER_SIZE];  // Length-prefixed frames: length and header check
+    int headerSize;
+    int remaining;              // Length-prefixed frames: payload and frame check bytes still to come
+};
+
+// The codec of a frame check, byte stuffed or length-prefixed ("raw").
+const FrameCodec *frameCodec(FCS_TYPE fcs, int raw);
+
+// Build the I frame of payload with the codec's framing into out (room for
+// FRAME_MAX(size) bytes). Return its size.
+int codecEncode(const FrameCodec *codec, unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out);
+
+// Build the byte stuffed frame FLAG A C BCC1, stuffed payload and frame check,
+// FLAG into out (room for FRAME_MAX(size) bytes). Return its size.
+int encodeFrame(unsigned char A, unsigned char C, const unsigned char *payload, int size, FCS_TYPE fcs, unsigned char *out);
+
+// Start hunting for a FLAG.
+void decoderInit(FrameDecoder *d);
+
+// Set where I frame payloads are written (at most capacity bytes).
+void decoderSetPayload(FrameDecoder *d, unsigned char *payload, int capacity);
+
+// Set the codec of the I frames (byte stuffed, FCS_XOR after decoderInit).
+void decoderSetCodec(FrameDecoder *d, const FrameCodec *codec);
+
+// Same, for byte stuffed frames with the given frame check.
+void decoderSetCheck(FrameDecoder *d, FCS_TYPE fcs);
+
+// Decode bytes from in. Stops right after the first complete frame, which is
+// described in frame (kind is FRAME_NONE when none was completed).
+// Returns the number of bytes consumed.
+int decodeFrame(FrameDecoder *d, const unsigned char *in, int n, Frame *frame);
+
+#endif // _FRAME_DECODER_H_
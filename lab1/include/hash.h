@@ -0,0 +1,31 @@
+// Content hashing.
+// xxHash64: a fast non-cryptographic 64-bit hash, one-shot or fed in pieces.
+// Used to identify file blocks and chunks and to check whole transfers.
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t total;             // Bytes hashed so far
+    uint64_t v[4];              // Lane accumulators
+    unsigned char mem[32];      // Bytes waiting for a full 32-byte stripe
+    int memSize;
+    uint64_t seed;
+} HashState;
+
+// Start a new hash.
+void hashInit(HashState *state, uint64_t seed);
+
+// Add len bytes to the hash.
+void hashUpdate(HashState *state, const void *data, size_t len);
+
+// Hash of everything added so far. The state can keep being updated.
+uint64_t hashDigest(const HashState *state);
+
+// Hash of a single buffer.
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif // _HASH_H_
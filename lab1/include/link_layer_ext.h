@@ -0,0 +1,50 @@
+// Link layer extensions.
+// link_layer.h is the fixed interface of the project, so the additional
+// calls offered by our link layer are declared here.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+// Set the number of frames the receiver is prepared to take and advertise it
+// to the transmitter (RR with credit, or RNR when credit is 0).
+// Only meaningful on the receiver side after llopen.
+// Return "1" on success or "-1" on error.
+int llsetcredit(int credit);
+
+// Enable or disable full-duplex mode. Both sides must call it with the same value
+// before llopen. Both can then call llwrite and llread: acknowledgements are
+// piggybacked on information frames (N(R) next to N(S)) when one is about to
+// leave, and frames that arrive while llwrite waits are queued for llread.
+// Return "1" on success or "-1" when the connection is already open.
+int llsetduplex(int enable);
+
+// Choose the frame check of the information frames (FCS_TYPE in crc.h: XOR
+// BCC2, CRC-16, CRC-32 or CRC-32C). The transmitter asks for it in SET before
+// llopen, and the receiver confirms it in UA; the receiver needs no call.
+// Return "1" on success or "-1" when the type is unknown or the connection is open.
+int llsetcheck(int type);
+
+// Ask for length-prefixed information frames, sent without byte stuffing.
+// Only for 8-bit clean links (ptys, sockets): a lost byte costs the frame it
+// falls in and possibly the next one. The transmitter asks for it in SET before
+// llopen, and the receiver confirms it in UA.
+// Return "1" on success or "-1" when the connection is open.
+int llsetframing(int lengthPrefixed);
+
+// Number of received frames queued in duplex mode; llread returns them
+// without blocking.
+int llpending();
+
+// Queue buf to share an information frame with the packets queued around it.
+// The frame leaves once the next packet would not fit in MAX_PAYLOAD_SIZE, or on
+// llflush, llwrite or llclose. llread on the other side returns the packets one
+// at a time, so the receiver needs no changes.
+// Return "0" on success or "-1" when a frame could not be sent.
+int llqueue(const unsigned char *buf, int bufSize);
+
+// Send the packets queued by llqueue now. With nothing queued, an acknowledgement
+// waiting to be piggybacked (duplex mode) is sent on its own.
+// Return "0" on success or "-1" on error.
+int llflush();
+
+#endif // _LINK_LAYER_EXT_H_
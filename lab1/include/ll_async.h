@@ -0,0 +1,64 @@
+// Asynchronous link layer interface.
+// A worker thread owns the blocking link layer (llopen/llwrite/llread/llclose).
+// Callers queue send buffers and collect completions and received frames
+// without blocking. lleventfd() returns a descriptor that is readable whenever
+// events are waiting, so it can be added to the caller's own poll/epoll loop.
+
+#ifndef _LL_ASYNC_H_
+#define _LL_ASYNC_H_
+
+#include "link_layer.h"
+
+#define LL_EVENT_RING   256     // Events waiting to be collected before the worker stops reading
+
+typedef enum
+{
+    LlOpened,       // llopen finished: size is 1 on success, -1 on error
+    LlSent,         // A submitted buffer was acknowledged by the receiver
+    LlSendFailed,   // A submitted buffer could not be delivered
+    LlReceived,     // A frame was received: data/size hold it, the caller frees data
+    LlClosed,       // The peer disconnected or the worker stopped
+} LlEventType;
+
+typedef struct
+{
+    LlEventType type;
+    const unsigned char *buf;   // LlSent / LlSendFailed: the buffer given to llsubmit
+    unsigned char *data;        // LlReceived: malloc'd payload, owned by the caller
+    int size;
+    void *user;                 // LlSent / LlSendFailed: the tag given to llsubmit
+} LlEvent;
+
+// Called by lldispatch for each event.
+typedef void (*LlCallback)(const LlEvent *event, void *arg);
+
+// Start the worker and open the connection in it. Returns immediately: the
+// outcome arrives as an LlOpened event. callback may be NULL when events are
+// collected with llpoll. SIGALRM (the link layer timer) is blocked in the calling
+// thread so that it is always handled by the worker.
+// Return "1" on success or "-1" on error.
+int llopenasync(LinkLayer connectionParameters, LlCallback callback, void *arg);
+
+// Descriptor that becomes readable when events are waiting.
+int lleventfd();
+
+// Queue buf for sending. buf must stay valid until its LlSent / LlSendFailed event.
+// Return "1" on success or "-1" on error.
+int llsubmit(const unsigned char *buf, int bufSize, void *user);
+
+// Copy up to max waiting events into events. Never blocks.
+// Return the number of events copied.
+int llpoll(LlEvent *events, int max);
+
+// Hand every waiting event to the callback given to llopenasync. Never blocks.
+// Return the number of events dispatched.
+int lldispatch();
+
+// Wait for the queued buffers to be sent, stop the worker and close the connection.
+// On the receiver the connection closes when the transmitter disconnects, so this
+// waits for it. Events still waiting are then handed to the callback (received
+// data is freed if there is none).
+// Return "1" on success or "-1" on error.
+int llcloseasync(int showStatistics);
+
+#endif // _LL_ASYNC_H_
@@ -0,0 +1,20 @@
+// Reliable one-to-many transfers.
+// One transmitter feeds several receivers through the fan-out cable
+// ("cable -n N"). Packets are numbered and sent once, without waiting for
+// acknowledgements. Then the transmitter polls. Each receiver answers with
+// the packets it is missing (NACK) or that it is done, and the transmitter
+// repairs the union of the missing packets once for everyone before polling
+// again.
+
+#ifndef _MULTICAST_H_
+#define _MULTICAST_H_
+
+// Send filename to "receivers" receivers, numbered 1 to receivers.
+// Return "0" when every receiver got the whole file or "-1" otherwise.
+int mcSend(const char *serialPort, int baudRate, int receivers, int nTries, int timeout, const char *filename);
+
+// Receive filename as receiver "id" (1 to 255).
+// Return "0" when the whole file was received or "-1" otherwise.
+int mcReceive(const char *serialPort, int baudRate, int id, int nTries, int timeout, const char *filename);
+
+#endif // _MULTICAST_H_
@@ -0,0 +1,49 @@
+// Hot path profiling probes.
+// Probes are only compiled in when PROFILE is defined (make profile); otherwise
+// every macro expands to nothing and the instrumented code is unchanged.
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+typedef enum {
+    PROF_LLWRITE,       // Whole llwrite call
+    PROF_LLREAD,        // Whole llread call
+    PROF_FILE_READ,     // Reading the file to send
+    PROF_PACKET_BUILD,  // Building application packets
+    PROF_STUFFING,      // BCC2 and byte stuffing of an I frame
+    PROF_WRITE,         // write() syscalls on the serial port
+    PROF_ACK_WAIT,      // Waiting for the RR / REJ / RNR of a frame
+    PROF_READ,          // read() syscalls on the serial port
+    PROF_DEFRAME,       // Frame state machine and destuffing
+    PROF_BCC_CHECK,     // BCC2 verification of a received frame
+    PROF_DISK_WRITE,    // Writing received data to the file
+    PROF_PHASES
+} PROF_PHASE;
+
+#ifdef PROFILE
+
+// Open a probe for "phase", nested inside the currently open one.
+void profBegin(PROF_PHASE phase);
+
+// Close the probe of "phase", also closing any probe left open inside it
+// (e.g. by an early return).
+void profEnd(PROF_PHASE phase);
+
+// Print the per-phase breakdown of the run and write the collapsed stacks
+// (flame graph input, one "root;phase;phase microseconds" line per stack) to
+// profile-<name>.folded.
+void profReport(const char *name);
+
+#define PROF_BEGIN(phase)   profBegin(phase)
+#define PROF_END(phase)     profEnd(phase)
+#define PROF_REPORT(name)   profReport(name)
+
+#else
+
+#define PROF_BEGIN(phase)   ((void) 0)
+#define PROF_END(phase)     ((void) 0)
+#define PROF_REPORT(name)   ((void) 0)
+
+#endif // PROFILE
+
+#endif // _PROFILE_H_
@@ -6,16 +6,22 @@ typedef enum {
     FLAG_RCV,
     A_RCV,
     C_RCV,
+    CREDIT_RCV,
     BCC1_RCV,
     READING,
-    BYTE_STUFF
+    BYTE_STUFF,
+    RAW_HEADER,     // Length-prefixed framing: length and header check after C
+    RAW_DATA,       // Length-prefixed framing: payload and frame check, taken as they come
+    RAW_END         // Length-prefixed framing: closing FLAG
 } STATE;
 
 #define BUF_SIZE 256
+#define RX_BUF_SIZE 4096    // Bytes read from the serial port at a time
 
 #define FLAG    0x7E    // Synchronisation: start or end of frame
 #define AT      0x03    // Address field in frames that are commands sent by the Transmitter or replies sent by the Receiver
 #define AR      0x01    // Address field in frames that are commands sent by the Receiver or replies sent by the Transmitter
+#define AM      0x05    // Address field in multicast frames sent by the Transmitter to every Receiver
 
 #define ESC_B1  0x7D    // First Escape Byte for Byte Stuffing (0x7E == 0x7D 0x5E)
 #define ESC_B2  0x5E    // First/Second Escape Byte for Byte Stuffing (0x7E == 0x7D 0x5E or 0x7D == 0x7D 0x5D)
@@ -29,10 +35,25 @@ typedef enum {
 #define REJ0    0x01    // REJ0 frame: indication sent by the Receiver that it rejects an information frame number 0 (detected an error)
 #define REJ1    0x81    // REJ1 frame: indication sent by the Receiver that it rejects an information frame number 1 (detected an error)
 #define DISC    0x0B    // DISC frame to indicate the termination of a connection
+#define RNR0    0x09    // RNR0 frame: indication sent by the Receiver that it is not ready to receive an information frame number 0
+#define RNR1    0x89    // RNR1 frame: indication sent by the Receiver that it is not ready to receive an information frame number 1
+
+/* Flow control */
+#define CREDIT          0x10    // Credit bit: set in the C field of an RR frame carrying a credit byte (FLAG A C CREDIT BCC1 FLAG)
+#define MAX_CREDIT      0x3F    // Largest credit advertised, keeps the credit byte and its BCC1 clear of FLAG and ESC_B1
+#define OPTIONS         0x10    // Options bit: set in the C field of a SET/UA frame carrying an options byte, in the same form
+#define FCS_MASK        0x03    // Options byte: frame check of the I frames (FCS_TYPE), requested in SET and confirmed in UA
+#define RAW_FRAMING     0x04    // Options byte: length-prefixed I frames without byte stuffing
+#define DEFAULT_CREDIT  1       // Frames the Receiver advertises it can take after each acknowledgement
+#define RX_QUEUE        8       // Frames a duplex station holds until llread takes them
+#define RNR_POLLS       10      // Number of timeouts the Transmitter waits on a busy Receiver before giving up
 
 /* Tramas I */
 #define CI_0    0x00    // Information frame number 0
 #define CI_1    0x40    // Information frame number 1
+#define NR_BIT  0x80    // N(R): number of the next frame expected from the peer, piggybacked in duplex mode
+#define AGG_BIT 0x20    // Aggregated frame: the payload holds several packets, each after a SUB_HEADER
+#define SUB_HEADER 2    // Bytes before each packet of an aggregated frame: its size (MSB first)
 #define SIZE    0x00    // File Size: Control Package byte corresponding to the File Size
 #define F_NAME  0x01    // File Name: Control Package byte corresponding to the File Name
 
@@ -43,5 +64,21 @@ typedef enum {
 #define CTRL_DATA       1       // Control Field 1: Control Field value related to Data Frame
 #define CTRL_START      2       // Control Field 2: Control Field value related to Control Frame 1
 #define CTRL_END        3       // Control Field 3: Control Field value related to Control Frame 2
+#define CTRL_HOLE       4       // Control Field 4: run of zero bytes, sent as its length only (L V1..VL)
+#define CTRL_SIGS       5       // Control Field 5: block signatures of the Receiver's copy (delta mode)
+#define CTRL_COPY       6       // Control Field 6: copy blocks of the Receiver's copy (delta mode)
+#define CTRL_CHUNK      7       // Control Field 7: chunk the Receiver has in its chunk store (dedup mode)
+#define CTRL_ASK        8       // Control Field 8: chunks the Transmitter would send as references (dedup mode)
+#define CTRL_HAVE       9       // Control Field 9: which of the asked chunks the Receiver has stored (dedup mode)
+
+#define TLV_SIZE        0       // Control packet field 0: file size
+#define TLV_NAME        1       // Control packet field 1: file name
+#define TLV_HASH        2       // Control packet field 2: xxHash64 of the file content (END only)
+
+#define ZERO_RUN        64      // Shortest run of zero bytes in the data sent as a hole
+
+#define MAX_NAME        256     // Longest file name handled by the application
+
+#define SYNC_SIZE       65536   // Bytes the Receiver writes between disk syncs (the link is paused with RNR meanwhile)
 
 #endif // _UTILS_H
@@ -1,5 +1,7 @@
 // Application layer protocol implementation
 
+#define _GNU_SOURCE     // SEEK_DATA / SEEK_HOLE, fallocate
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,7 +12,14 @@
 #include <termios.h>
 #include <unistd.h>
 #include <math.h>
+#include "chunk_store.h"
+#include "crc.h"
+#include "delta.h"
+#include "hash.h"
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "multicast.h"
+#include "profile.h"
 #include "utils.h"
 #include "application_layer.h"
 
@@ -26,22 +35,23 @@ LinkLayer buildConnectionParams(const char *serialPort, const char *role, int ba
     connectionParams.nRetransmissions = nTries;
     connectionParams.timeout = timeout;
 
-    connectionParams.role = strcmp(role, "tx") ? LlRx : LlTx; 
+    connectionParams.role = strncmp(role, "tx", 2) ? LlRx : LlTx;   // "tx" or "tx+rx"
 
     return connectionParams;
 }
 
-unsigned char * constructControlPacket(int type, const char* filename, unsigned long V1, unsigned long *packetSize){
+// "hash", when given, is added as a TLV_HASH field.
+unsigned char * constructControlPacket(int type, const char* filename, unsigned long V1, const HashState *hash, unsigned long *packetSize){
     int L1 = ceil(log2(V1)/8);
     int L2 = strlen(filename);
 
-    *packetSize = 1 + 2 + L1 + 2 + L2;
+    *packetSize = 1 + 2 + L1 + 2 + L2 + (hash != NULL ? 2 + 8 : 0);
 
     unsigned char* controlPacket = (unsigned char *)malloc(*packetSize);
     int index = 0;
 
     controlPacket[index++] = type;
-    controlPacket[index++] = 0;
+    controlPacket[index++] = TLV_SIZE;
     controlPacket[index++] = L1;
 
     for(unsigned char i = 0; i < L1; i++){
@@ -50,90 +60,644 @@ unsigned char * constructControlPacket(int type, const char* filename, unsigned
         index++;
     }
 
-    controlPacket[index++] = 1;
+    controlPacket[index++] = TLV_NAME;
     controlPacket[index++] = L2;
     memcpy(controlPacket + index, filename, L2);
+    index += L2;
+
+    if(hash != NULL){
+        controlPacket[index++] = TLV_HASH;
+        controlPacket[index++] = 8;
+        putBE(controlPacket + index, hashDigest(hash), 8);
+    }
 
     return controlPacket;
 }
 
 
-int trasmitterTasks(const char *filename){
-    FILE* penguin = fopen(filename, "rb");
-    if(penguin == NULL){
+// Size of the data packets sent. Defaults to the largest payload; RCOM_PACKET_SIZE lowers it
+// (used by the benchmarks to sweep the frame size).
+int packetSize(){
+    const char *env = getenv("RCOM_PACKET_SIZE");
+    int size = env == NULL ? MAX_PAYLOAD_SIZE : atoi(env);
+    return (size <= D_SIZE || size > MAX_PAYLOAD_SIZE) ? MAX_PAYLOAD_SIZE : size;
+}
+
+// Chunk of the file being sent, at offset.
+typedef struct {
+    ChunkKey key;
+    long offset;
+    int length;
+} SentChunk;
+
+// Chunks by key. The table is open addressing on the key: index in chunks + 1, 0 when empty.
+typedef struct {
+    SentChunk *chunks;
+    long count, capacity;
+    long *table;
+} ChunkSet;
+
+// File being sent, one packet per sendNext() call.
+typedef struct {
+    const char *filename;
+    int fd;
+    long fileSize;
+    long sent;
+    int stage;      // CTRL_START, CTRL_DATA, CTRL_END, or 0 once END was sent
+    int delta;      // Send the differences from the receiver's copy
+    BlockSig *sigs;
+    DeltaScan scan;
+    HashState hash; // Of the bytes sent so far, carried by END
+    int dedup;      // Send chunks the receiver has stored as references
+    unsigned char *chunk;
+    int chunkLen, chunkPos;     // Current chunk, and how much of it was sent
+    ChunkSet held;              // Chunks the receiver said its store has
+    ChunkSet newChunks;         // Sent as data, added to our store once END was acknowledged
+} SendJob;
+
+// File being received, one packet per receivePacket() call.
+typedef struct {
+    const char *filename;
+    FILE *file;
+    unsigned long fileSize;
+    unsigned long unsynced;
+    int stage;      // CTRL_START until START arrives, CTRL_DATA, or 0 once END arrived
+    int delta;      // Offer our copy of the file to rebuild the new one from
+    int oldFd;      // Delta: the previous copy, replaced at END
+    int blockSize;
+    char partName[MAX_NAME];
+    HashState hash; // Of the bytes written so far, checked against END
+    int dedup;      // Keep the chunks of the file in the chunk store
+    unsigned char *stream;      // Bytes of the current chunk received so far
+    int streamLen;
+    Chunker chunker;
+} RecvJob;
+
+// Delta transfers (rsync style) are used when RCOM_DELTA is set on both sides.
+int deltaMode(){
+    const char *env = getenv("RCOM_DELTA");
+    return env != NULL && strcmp(env, "0") != 0;
+}
+
+// Chunk deduplication is used when RCOM_CHUNK_STORE names the store directory on both sides.
+int dedupRequested(){
+    const char *env = getenv("RCOM_CHUNK_STORE");
+    return env != NULL && *env != '\0';
+}
+
+// Open the chunk store of dedup mode. The receiver tells the transmitter which chunks its
+// store has, so the two stores need not be in step.
+int dedupMode(){
+    const char *env = getenv("RCOM_CHUNK_STORE");
+    if(!dedupRequested()) return FALSE;
+    if(storeOpen(env) < 0){
+        printf("[ERROR - Couldnt Open Chunk Store %s]\n", env);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Dedup mode: index of the chunk in the set, or -1.
+long findChunk(const ChunkSet *set, ChunkKey key){
+    if(set->capacity == 0) return -1;
+    for(long slot = key.lo & (2 * set->capacity - 1); set->table[slot] != 0; slot = (slot + 1) & (2 * set->capacity - 1)){
+        const SentChunk *c = &set->chunks[set->table[slot] - 1];
+        if(c->key.hi == key.hi && c->key.lo == key.lo) return set->table[slot] - 1;
+    }
+    return -1;
+}
+
+// Dedup mode: add a chunk to the set. The table is kept at most half full.
+void addChunk(ChunkSet *set, ChunkKey key, long offset, int length){
+    if(set->count == set->capacity){
+        set->capacity = set->capacity ? 2 * set->capacity : 64;
+        set->chunks = (SentChunk *) realloc(set->chunks, set->capacity * sizeof(SentChunk));
+        free(set->table);
+        set->table = (long *) calloc(2 * set->capacity, sizeof(long));
+        for(long i = 0; i < set->count; i++){
+            long slot = set->chunks[i].key.lo & (2 * set->capacity - 1);
+            while(set->table[slot] != 0) slot = (slot + 1) & (2 * set->capacity - 1);
+            set->table[slot] = i + 1;
+        }
+    }
+
+    SentChunk *c = &set->chunks[set->count++];
+    c->key = key;
+    c->offset = offset;
+    c->length = length;
+    long slot = key.lo & (2 * set->capacity - 1);
+    while(set->table[slot] != 0) slot = (slot + 1) & (2 * set->capacity - 1);
+    set->table[slot] = set->count;
+}
+
+void freeChunkSet(ChunkSet *set){
+    free(set->chunks);
+    free(set->table);
+    memset(set, 0, sizeof(*set));
+}
+
+int openSendJob(SendJob *job, const char *filename){
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
         printf("file not found\n");
         return -1;
     }
 
-    int fPos = ftell(penguin);
-    fseek(penguin, 0, SEEK_END);
-    int fileSize = ftell(penguin) - fPos;
-    fseek(penguin, fPos, SEEK_SET);
-    unsigned long cPacketSize;
+    job->filename = filename;
+    job->fd = fd;
+    job->fileSize = lseek(fd, 0, SEEK_END);
+    job->sent = 0;
+    job->stage = CTRL_START;
+    job->delta = FALSE;
+    job->sigs = NULL;
+    job->dedup = FALSE;
+    job->chunk = NULL;
+    job->chunkLen = job->chunkPos = 0;
+    memset(&job->held, 0, sizeof(job->held));
+    memset(&job->newChunks, 0, sizeof(job->newChunks));
+    job->scan.table = NULL;
+    job->scan.buffer = NULL;
+    hashInit(&job->hash, 0);
+
+    return 0;
+}
+
+// Release what the job still holds, whether it finished or failed.
+void closeSendJob(SendJob *job){
+    if(job->fd >= 0) close(job->fd);
+    job->fd = -1;
+    deltaFree(&job->scan);
+    free(job->sigs);
+    free(job->chunk);
+    freeChunkSet(&job->held);
+    freeChunkSet(&job->newChunks);
+    job->chunk = NULL;
+    job->sigs = NULL;
+}
+
+// Delta mode: collect the signatures of the receiver's copy and prepare to encode against them.
+// Return "0" on success or "-1" on error.
+int receiveSignatures(SendJob *job){
+    unsigned char *packet = (unsigned char *) malloc (MAX_PAYLOAD_SIZE);
+    long received = 0, total = -1;
+    int blockSize = DELTA_MIN_BLOCK;
+
+    while(total < 0 || received < total){
+        // Rejected frames are retried below llread in duplex mode, so an error means the link failed
+        int size = llread(packet);
+        if(size < 13 || packet[0] != CTRL_SIGS){
+            printf("[ERROR - Expected Signatures From The Receiver]\n");
+            free(packet);
+            free(job->sigs);
+            job->sigs = NULL;
+            return -1;
+        }
+
+        if(total < 0){
+            blockSize = getBE(packet + 1, 4);
+            total = getBE(packet + 5, 4);
+            if(blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK || total > DELTA_MAX_BLOCKS){
+                printf("[ERROR - Bad Signatures: %ld Blocks of %d Bytes]\n", total, blockSize);
+                free(packet);
+                return -1;
+            }
+            job->sigs = (BlockSig *) malloc((total > 0 ? total : 1) * sizeof(BlockSig));
+            if(job->sigs == NULL){
+                printf("[ERROR - Couldnt Allocate Signatures]\n");
+                free(packet);
+                return -1;
+            }
+        }
+        long first = getBE(packet + 9, 4);
+        int n = (size - 13) / SIG_SIZE;
+        for(int i = 0; i < n && first + i < total; i++){
+            job->sigs[first + i].weak = getBE(packet + 13 + i * SIG_SIZE, 4);
+            job->sigs[first + i].strong = getBE(packet + 17 + i * SIG_SIZE, 8);
+        }
+        received += n;
+    }
+    free(packet);
+    printf("  -Receiving Signatures [%ld Blocks of %d Bytes]\n", total, blockSize);
+
+    // Acknowledge the last one now instead of with our first frame
+    llflush();
+
+    // The file is read as the scan moves over it
+    if(deltaInit(&job->scan, job->fd, job->fileSize, blockSize, job->sigs, total) < 0){
+        free(job->sigs);
+        job->sigs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Delta mode: send the next literal run or block reference.
+// Return "0" on success or "-1" on error.
+int sendDelta(SendJob *job){
+    DeltaOp op;
+    int maxData = packetSize() - D_SIZE;
+
+    PROF_BEGIN(PROF_FILE_READ);
+    int next = deltaNext(&job->scan, maxData, &op);
+    PROF_END(PROF_FILE_READ);
+    if(next < 0){
+        printf("[ERROR - Couldnt Read File]\n");
+        return -1;
+    }
+    if(next == 0){
+        job->stage = CTRL_END;
+        return 0;
+    }
 
-    unsigned char* cPacket = constructControlPacket(2, filename, fileSize, &cPacketSize);
+    if(op.type == DELTA_COPY){
+        unsigned char packet[9];
+        packet[0] = CTRL_COPY;
+        putBE(packet + 1, op.block, 4);
+        putBE(packet + 5, op.count, 4);
+        printf("    -Sending Copy [%ld Blocks]\n", op.count);
+        if(llqueue(packet, sizeof(packet)) == -1){
+            printf("[ERROR - Couldnt Send Copy Packet]\n");
+            return -1;
+        }
+        hashUpdate(&job->hash, deltaData(&job->scan, job->sent), op.count * job->scan.blockSize);
+        job->sent += op.count * job->scan.blockSize;
+        return 0;
+    }
 
-    if(llwrite(cPacket, cPacketSize) == -1){
-        printf("[ERROR - Couldnt Send Control Packet START] \n");
+    unsigned char *data = (unsigned char*) malloc(op.length + 3);
+    data[0] = CTRL_DATA;
+    data[1] = (op.length >> 8) & 0xFF;
+    data[2] = op.length & 0xFF;
+    memcpy(data + 3, deltaData(&job->scan, op.offset), op.length);
+    if(llqueue(data, op.length + 3) == -1){
+        printf("[ERROR - Couldnt Send Data Packet]\n");
+        free(data);
         return -1;
     }
+    free(data);
+    hashUpdate(&job->hash, deltaData(&job->scan, op.offset), op.length);
+    job->sent += op.length;
+    return 0;
+}
 
-    free(cPacket);
+// Dedup mode: the receiver has every chunk of the file now, record the new ones in our store too.
+void storeNewChunks(SendJob *job){
+    for(long i = 0; i < job->newChunks.count; i++){
+        SentChunk *c = &job->newChunks.chunks[i];
+        if(pread(job->fd, job->chunk, c->length, c->offset) != c->length || storePut(c->key, job->chunk, c->length) < 0){
+            printf("[ERROR - Couldnt Add Chunk To The Store]\n");
+            return;
+        }
+    }
+    printf("  -Storing Chunks [%ld New]\n", job->newChunks.count);
+}
 
-    unsigned char *fileContent = (unsigned char*) malloc(sizeof(unsigned char) * fileSize);
-    fread(fileContent, sizeof(unsigned char), fileSize, penguin);
+// Dedup mode: read the chunk of the file that starts at pos into job->chunk.
+// Return its length, or "-1" when the file couldnt be read.
+int readChunk(SendJob *job, long pos){
+    long want = job->fileSize - pos < CDC_MAX ? job->fileSize - pos : CDC_MAX;
+    PROF_BEGIN(PROF_FILE_READ);
+    for(long done = 0; done < want; ){
+        long got = pread(job->fd, job->chunk + done, want - done, pos + done);
+        if(got <= 0){
+            PROF_END(PROF_FILE_READ);
+            printf("[ERROR - Couldnt Read File]\n");
+            return -1;
+        }
+        done += got;
+    }
+    PROF_END(PROF_FILE_READ);
 
-    int totalSent = 0;
+    Chunker chunker;
+    chunkerInit(&chunker);
+    int cut = chunkerScan(&chunker, job->chunk, want);
+    return cut > 0 ? cut : want;    // no cut: the file ends first
+}
 
-    //send data packets
-    while(totalSent < fileSize){
-        int remainingBytes = fileSize - totalSent;
-        int dataSize = remainingBytes> (MAX_PAYLOAD_SIZE-3) ? (MAX_PAYLOAD_SIZE-3) : remainingBytes;
-        int L1 = dataSize & 0xFF;
-        int L2 = (dataSize >> 8) & 0xFF;
-        unsigned char *data = (unsigned char*) malloc(dataSize+3);
-        data[0] = 1;
-        data[1] = L2;
-        data[2] = L1;
-        memcpy(data+3, fileContent, dataSize);
-        if(llwrite(data, dataSize+3) == -1){
-            printf("[ERROR - Couldnt Send Data Packet]\n");
+// Dedup mode: ask the receiver which of the chunks of the file our store has are in its store
+// too, and keep those it has in job->held. The others are sent as data.
+// Return "0" on success or "-1" on error.
+int askChunks(SendJob *job){
+    // Cut the file the way sendChunk will
+    ChunkSet asked;
+    memset(&asked, 0, sizeof(asked));
+    for(long pos = 0; pos < job->fileSize; ){
+        int length = readChunk(job, pos);
+        if(length < 0){
+            freeChunkSet(&asked);
             return -1;
         }
-        totalSent += dataSize;
-        fileContent += dataSize;
+        ChunkKey key = chunkKey(job->chunk, length);
+        if(findChunk(&asked, key) < 0 && storeHas(key)) addChunk(&asked, key, pos, length);
+        pos += length;
+    }
+    printf("  -Asking For Chunks [%ld Stored]\n", asked.count);
+    if(asked.count == 0) return 0;
+
+    unsigned char *packet = (unsigned char *) malloc (MAX_PAYLOAD_SIZE);
+    int perPacket = (MAX_PAYLOAD_SIZE - 9) / KEY_SIZE;
+    for(long first = 0; first < asked.count; first += perPacket){
+        int n = asked.count - first < perPacket ? asked.count - first : perPacket;
+        packet[0] = CTRL_ASK;
+        putBE(packet + 1, asked.count, 4);
+        putBE(packet + 5, first, 4);
+        for(int i = 0; i < n; i++){
+            putBE(packet + 9 + i * KEY_SIZE, asked.chunks[first + i].key.hi, 8);
+            putBE(packet + 17 + i * KEY_SIZE, asked.chunks[first + i].key.lo, 8);
+        }
+        if(llqueue(packet, 9 + n * KEY_SIZE) == -1){
+            printf("[ERROR - Couldnt Ask For Chunks]\n");
+            free(packet);
+            freeChunkSet(&asked);
+            return -1;
+        }
+    }
+
+    // The answers come in the order asked: CTRL_HAVE F1..F4 N1..N4 and a bit per chunk
+    long answered = 0;
+    int result = llflush() == -1 ? -1 : 0;
+    while(result == 0 && answered < asked.count){
+        // Rejected frames are retried below llread in duplex mode, so an error means the link failed
+        int size = llread(packet);
+        long first = size >= 9 ? (long) getBE(packet + 1, 4) : -1;
+        long n = size >= 9 ? (long) getBE(packet + 5, 4) : 0;
+        if(size < 9 || packet[0] != CTRL_HAVE || first != answered || n > asked.count - first || size < 9 + (n + 7) / 8){
+            printf("[ERROR - Expected Chunks Held By The Receiver]\n");
+            result = -1;
+            break;
+        }
+        for(long i = 0; i < n; i++){
+            SentChunk *c = &asked.chunks[first + i];
+            if(packet[9 + i / 8] & (1 << (i % 8))) addChunk(&job->held, c->key, c->offset, c->length);
+        }
+        answered += n;
+    }
+    if(result == 0) printf("  -Receiving Chunks Held [%ld Of %ld]\n", job->held.count, asked.count);
+
+    free(packet);
+    freeChunkSet(&asked);
+    return result;
+}
+
+// Dedup mode: send a reference to the next chunk when the receiver has it, or its next data packet.
+// Return "0" on success or "-1" on error.
+int sendChunk(SendJob *job){
+    if(job->chunkPos == job->chunkLen){
+        job->chunkLen = readChunk(job, job->sent);
+        if(job->chunkLen < 0) return -1;
+        job->chunkPos = 0;
+
+        // In the receiver's store, or sent already in this transfer
+        ChunkKey key = chunkKey(job->chunk, job->chunkLen);
+        hashUpdate(&job->hash, job->chunk, job->chunkLen);
+        if(findChunk(&job->held, key) >= 0 || findChunk(&job->newChunks, key) >= 0){
+            unsigned char packet[21];
+            packet[0] = CTRL_CHUNK;
+            putBE(packet + 1, key.hi, 8);
+            putBE(packet + 9, key.lo, 8);
+            putBE(packet + 17, job->chunkLen, 4);
+            printf("    -Sending Chunk Reference [%d Bytes]\n", job->chunkLen);
+            if(llqueue(packet, sizeof(packet)) == -1){
+                printf("[ERROR - Couldnt Send Chunk Reference]\n");
+                return -1;
+            }
+            job->sent += job->chunkLen;
+            job->chunkPos = job->chunkLen;
+            if(job->sent == job->fileSize) job->stage = CTRL_END;
+            return 0;
+        }
+        addChunk(&job->newChunks, key, job->sent, job->chunkLen);
+    }
+
+    // Data packets never span two chunks
+    int maxData = packetSize() - D_SIZE;
+    int dataSize = job->chunkLen - job->chunkPos < maxData ? job->chunkLen - job->chunkPos : maxData;
+    unsigned char *data = (unsigned char*) malloc(dataSize + 3);
+    data[0] = CTRL_DATA;
+    data[1] = (dataSize >> 8) & 0xFF;
+    data[2] = dataSize & 0xFF;
+    memcpy(data + 3, job->chunk + job->chunkPos, dataSize);
+    if(llqueue(data, dataSize + 3) == -1){
+        printf("[ERROR - Couldnt Send Data Packet]\n");
         free(data);
+        return -1;
     }
+    free(data);
+    job->chunkPos += dataSize;
+    job->sent += dataSize;
+
+    if(job->sent == job->fileSize) job->stage = CTRL_END;
+    return 0;
+}
+
+// Offset where the hole starting at pos ends (pos itself when pos holds data).
+// Files without hole support are all data.
+long holeEnd(int fd, long pos, long fileSize){
+#ifdef SEEK_DATA
+    long data = lseek(fd, pos, SEEK_DATA);
+    if(data < 0) return errno == ENXIO ? fileSize : pos;   // ENXIO: only a hole is left
+    return data;
+#else
+    return pos;
+#endif
+}
+
+// Offset where the data starting at pos ends.
+long dataEnd(int fd, long pos, long fileSize){
+#ifdef SEEK_HOLE
+    long hole = lseek(fd, pos, SEEK_HOLE);
+    return hole < 0 ? fileSize : hole;
+#else
+    return fileSize;
+#endif
+}
+
+// Number of zero bytes from pos on, up to limit.
+long zeroRun(int fd, long pos, long limit){
+    unsigned char block[4096];
+    long run = 0;
+
+    while(pos + run < limit){
+        long want = limit - pos - run < (long) sizeof(block) ? limit - pos - run : (long) sizeof(block);
+        PROF_BEGIN(PROF_FILE_READ);
+        long got = pread(fd, block, want, pos + run);
+        PROF_END(PROF_FILE_READ);
+        if(got <= 0) break;
+
+        for(long i = 0; i < got; i++)
+            if(block[i] != 0) return run + i;
+        run += got;
+    }
+    return run;
+}
+
+// Offset in buf where the first run of at least ZERO_RUN zero bytes starts (size when there is none).
+int findZeroRun(const unsigned char *buf, int size){
+    int run = 0;
+    for(int i = 0; i < size; i++){
+        run = buf[i] == 0 ? run + 1 : 0;
+        if(run == ZERO_RUN) return i + 1 - ZERO_RUN;
+    }
+    return size;
+}
+
+// Add "length" zero bytes to a hash.
+void hashZeros(HashState *hash, long length){
+    static const unsigned char zeros[4096];
+    for(; length > 0; length -= sizeof(zeros))
+        hashUpdate(hash, zeros, length < (long) sizeof(zeros) ? length : (long) sizeof(zeros));
+}
+
+// Hole packet: "length" zero bytes the receiver skips, as CTRL_HOLE L V1..VL.
+int sendHole(long length){
+    unsigned char packet[2 + sizeof(long)];
+    int L = 0;
+    for(long v = length; v > 0; v >>= 8) L++;
+
+    packet[0] = CTRL_HOLE;
+    packet[1] = L;
+    for(int i = 0; i < L; i++)
+        packet[1 + L - i] = (length >> (8 * i)) & 0xFF;
 
-    unsigned char *cPacketEnd = constructControlPacket(3, filename, fileSize, &cPacketSize);
-    if(llwrite(cPacketEnd, cPacketSize) == -1){
-        printf("[ERROR - Couldnt Send Control Packet END] \n");
+    printf("    -Sending Hole [%ld Bytes]\n", length);
+    return llqueue(packet, 2 + L);
+}
+
+// Send the next packet of the job.
+// Return "0" on success or "-1" on error.
+int sendNext(SendJob *job){
+    unsigned long cPacketSize;
+
+    if(job->stage == CTRL_START || job->stage == CTRL_END){
+        PROF_BEGIN(PROF_PACKET_BUILD);
+        unsigned char* cPacket = constructControlPacket(job->stage, job->filename, job->fileSize,
+                                                        job->stage == CTRL_END ? &job->hash : NULL, &cPacketSize);
+        PROF_END(PROF_PACKET_BUILD);
+
+        // Control packets share frames with the data around them; END closes the last frame
+        int queued = llqueue(cPacket, cPacketSize);
+        free(cPacket);
+        if(queued == -1 || (job->stage == CTRL_END && llflush() == -1)){
+            printf("[ERROR - Couldnt Send Control Packet %s] \n", job->stage == CTRL_START ? "START" : "END");
+            return -1;
+        }
+
+        // Delta: the receiver answers START with the signatures of its copy
+        if(job->stage == CTRL_START && job->delta && (llflush() == -1 || receiveSignatures(job) < 0))
+            return -1;
+
+        // Dedup: references only go for chunks the receiver says it has
+        if(job->stage == CTRL_START && job->dedup && askChunks(job) < 0)
+            return -1;
+
+        if(job->stage == CTRL_END){
+            if(job->dedup) storeNewChunks(job);
+            closeSendJob(job);
+            job->stage = 0;
+        }
+        else job->stage = job->sent < job->fileSize ? CTRL_DATA : CTRL_END;
+        return 0;
+    }
+
+    if(job->delta) return sendDelta(job);
+    if(job->dedup) return sendChunk(job);
+
+    // Holes, and runs of zeros inside the data, are sent as their length only
+    long hole = holeEnd(job->fd, job->sent, job->fileSize) - job->sent;
+    long limit = dataEnd(job->fd, job->sent + hole, job->fileSize);
+    if(hole == 0){
+        long zeros = zeroRun(job->fd, job->sent, limit);
+        if(zeros >= ZERO_RUN) hole = zeros;
+    }
+    if(hole > 0){
+        if(sendHole(hole) == -1){
+            printf("[ERROR - Couldnt Send Hole Packet]\n");
+            return -1;
+        }
+        hashZeros(&job->hash, hole);
+        job->sent += hole;
+        if(job->sent == job->fileSize) job->stage = CTRL_END;
+        return 0;
+    }
+
+    //send data packets, up to the next hole or zero run
+    PROF_BEGIN(PROF_PACKET_BUILD);
+    int maxData = packetSize() - D_SIZE;
+    long remainingBytes = limit - job->sent;
+    int dataSize = remainingBytes > maxData ? maxData : remainingBytes;
+    unsigned char *data = (unsigned char*) malloc(dataSize+3);
+    PROF_BEGIN(PROF_FILE_READ);
+    dataSize = pread(job->fd, data + 3, dataSize, job->sent);
+    PROF_END(PROF_FILE_READ);
+    if(dataSize <= 0){
+        PROF_END(PROF_PACKET_BUILD);
+        printf("[ERROR - Couldnt Read File]\n");
+        free(data);
+        return -1;
+    }
+    dataSize = findZeroRun(data + 3, dataSize);
+    int L1 = dataSize & 0xFF;
+    int L2 = (dataSize >> 8) & 0xFF;
+    data[0] = 1;
+    data[1] = L2;
+    data[2] = L1;
+    hashUpdate(&job->hash, data + 3, dataSize);
+    PROF_END(PROF_PACKET_BUILD);
+    int queued = llqueue(data, dataSize+3);
+    free(data);
+    if(queued == -1){
+        printf("[ERROR - Couldnt Send Data Packet]\n");
         return -1;
     }
+    job->sent += dataSize;
 
+    if(job->sent == job->fileSize) job->stage = CTRL_END;
     return 0;
 }
 
-int parseCPacket(unsigned char* packet, int size, unsigned long int *fileSize, unsigned char **name){
-    unsigned char dataLengthB = 0, *fileSizeAux = NULL;
+int trasmitterTasks(const char *filename){
+    SendJob job;
+    if(openSendJob(&job, filename) < 0) return -1;
+    job.delta = deltaMode();
+    job.dedup = !job.delta && dedupMode();
+    if(job.dedup) job.chunk = (unsigned char *) malloc(CDC_MAX);
+
+    int result = 0;
+    while(job.stage != 0 && result == 0)
+        result = sendNext(&job);
+
+    closeSendJob(&job);
+    return result;
+}
+
+// "hashed" is set when the packet carries a TLV_HASH field, stored in "hash".
+int parseCPacket(unsigned char* packet, int size, unsigned long int *fileSize, unsigned char **name, uint64_t *hash, int *hashed){
+    unsigned char dataLengthB = 0;
+    *hashed = FALSE;
 
     for(int i = 1; i < size; i+= dataLengthB + 1){
         switch(packet[i]){
 
-            case 0: // File Size
+            case TLV_SIZE: // File Size
                 dataLengthB = packet[++i];
-                fileSizeAux = (unsigned char*)malloc(dataLengthB);
-                memcpy(fileSizeAux, packet+i+1, dataLengthB);
                 for(unsigned int j = 0; j < dataLengthB; j++)
-                    *fileSize = (*fileSize << 8) + fileSizeAux[j];
+                    *fileSize = (*fileSize << 8) + packet[i + 1 + j];
                 break;
 
-            case 1: // File Name
+            case TLV_NAME: // File Name
                 dataLengthB = packet[++i];
+                free(*name);
                 *name = (unsigned char*) malloc (dataLengthB);
                 memcpy(*name, packet+i+1, dataLengthB);
                 break;
 
+            case TLV_HASH: // File Hash
+                dataLengthB = packet[++i];
+                if(dataLengthB != 8 || i + 1 + dataLengthB > size) return -1;
+                *hash = getBE(packet + i + 1, 8);
+                *hashed = TRUE;
+                break;
+
             default:
                 return -1;
         }
@@ -142,61 +706,352 @@ int parseCPacket(unsigned char* packet, int size, unsigned long int *fileSize, u
     return 0;
 }
 
-int receiverTasks(const char *filename){
+// Delta mode: answer START with the signatures of the blocks of our copy of the file
+// (none when there is no copy).
+// Return "0" on success or "-1" on error.
+int sendSignatures(RecvJob *job){
+    job->oldFd = open(job->filename, O_RDONLY);
+    long oldSize = job->oldFd < 0 ? 0 : lseek(job->oldFd, 0, SEEK_END);
+    job->blockSize = deltaBlockSize(oldSize);
+    long blocks = oldSize / job->blockSize;    // a partial last block is sent as data anyway
+    int perPacket = (MAX_PAYLOAD_SIZE - 13) / SIG_SIZE;
+
+    printf("  -Sending Signatures [%ld Blocks of %d Bytes]\n", blocks, job->blockSize);
     unsigned char *packet = (unsigned char *) malloc (MAX_PAYLOAD_SIZE);
-    int packetSize = -1;
+    unsigned char *block = (unsigned char *) malloc (job->blockSize);
+    long first = 0;
+    do{
+        int n = blocks - first < perPacket ? blocks - first : perPacket;
+        packet[0] = CTRL_SIGS;
+        putBE(packet + 1, job->blockSize, 4);
+        putBE(packet + 5, blocks, 4);
+        putBE(packet + 9, first, 4);
+        for(int i = 0; i < n; i++){
+            if(pread(job->oldFd, block, job->blockSize, (first + i) * job->blockSize) != job->blockSize){
+                printf("[ERROR - Couldnt Read Block From The Old File]\n");
+                free(packet);
+                free(block);
+                return -1;
+            }
+            BlockSig sig = blockSignature(block, job->blockSize);
+            putBE(packet + 13 + i * SIG_SIZE, sig.weak, 4);
+            putBE(packet + 17 + i * SIG_SIZE, sig.strong, 8);
+        }
+        if(llwrite(packet, 13 + n * SIG_SIZE) == -1){
+            printf("[ERROR - Couldnt Send Signatures]\n");
+            free(packet);
+            free(block);
+            return -1;
+        }
+        first += n;
+    } while(first < blocks);
+
+    free(packet);
+    free(block);
+    return 0;
+}
 
-    int tries = 3;
-    while(packetSize < 0 && tries > 0){
-        packetSize = llread(packet);
-        if(packet[0] != CTRL_START) packetSize = -1;
-        else printf("  -Receiving Control Field [START]\n");
-        tries --;
+// Dedup mode: answer a CTRL_ASK packet with a bit for each of its chunks, set when our store has it.
+// Return "0" on success or "-1" on error.
+int answerChunks(const unsigned char *packet, int packetSize){
+    long first = getBE(packet + 5, 4);
+    int n = (packetSize - 9) / KEY_SIZE;
+    unsigned char *answer = (unsigned char *) calloc (9 + (n + 7) / 8, 1);
+    int held = 0;
+    answer[0] = CTRL_HAVE;
+    putBE(answer + 1, first, 4);
+    putBE(answer + 5, n, 4);
+    for(int i = 0; i < n; i++){
+        ChunkKey key = {getBE(packet + 9 + i * KEY_SIZE, 8), getBE(packet + 17 + i * KEY_SIZE, 8)};
+        if(storeHas(key)){
+            answer[9 + i / 8] |= 1 << (i % 8);
+            held++;
+        }
     }
+    printf("  -Answering For Chunks [%d Of %d Held]\n", held, n);
 
-    unsigned long int fileSize = 0, fileSizeEnd = 0;
-    unsigned char *name = NULL, *nameEnd = NULL;
-    if(parseCPacket(packet, packetSize, &fileSize, &name) < 0) return -1;
-    unsigned char *buf;
-    FILE* newFile = fopen(filename, "wb+");
+    int result = llwrite(answer, 9 + (n + 7) / 8);
+    free(answer);
+    if(result == -1){
+        printf("[ERROR - Couldnt Answer For Chunks]\n");
+        return -1;
+    }
+    return 0;
+}
 
-    while (packetSize > 0 && packet[0] != CTRL_END) {
+// Dedup mode: add the chunk to the store unless it is there already.
+void keepChunk(const unsigned char *data, int length){
+    ChunkKey key = chunkKey(data, length);
+    if(!storeHas(key) && storePut(key, data, length) < 0)
+        printf("[ERROR - Couldnt Add Chunk To The Store]\n");
+}
 
-        while ((packetSize = llread(packet)) < 0);
-        if(packetSize == 0){
-            packetSize = -1;
-            break;
+// Dedup mode: cut the bytes written to the file into chunks the same way the transmitter does.
+void feedChunker(RecvJob *job, const unsigned char *data, int length){
+    while(length > 0){
+        int take = CDC_MAX - job->streamLen < length ? CDC_MAX - job->streamLen : length;
+        memcpy(job->stream + job->streamLen, data, take);
+        job->streamLen += take;
+        data += take;
+        length -= take;
+
+        int cut;
+        while(job->streamLen > 0 && (cut = chunkerScan(&job->chunker, job->stream, job->streamLen)) > 0){
+            keepChunk(job->stream, cut);
+            memmove(job->stream, job->stream + cut, job->streamLen - cut);
+            job->streamLen -= cut;
         }
-        if(packet[0] == CTRL_DATA){
-            printf("    -Receiving Data\n");
-            packetSize = (packet[1] << 8) + packet[2];
-            buf = (unsigned char*) malloc (packetSize);
-            memcpy(buf, packet + 3, packetSize);
-            fwrite(buf, sizeof(unsigned char), packetSize, newFile);
-            free(buf);
+    }
+}
 
-        } else if(packet[0] == CTRL_END){
-            printf("  -Receiving Control Field [END]\n");
-            if(parseCPacket(packet, packetSize, &fileSizeEnd, &nameEnd) < 0) return -1;
-            
-            if(fileSize != fileSizeEnd)
-                printf("[ERROR - START AND END CONTROL FRAMES DO NOT MATCH]\n");
+// Release what the job still holds, whether it finished or failed.
+void closeRecvJob(RecvJob *job){
+    if(job->file != NULL) fclose(job->file);
+    if(job->oldFd >= 0) close(job->oldFd);
+    free(job->stream);
+    job->file = NULL;
+    job->oldFd = -1;
+    job->stream = NULL;
+}
 
-        } else{
-            printf("[ERROR - DATA PACKET DOESNT MATCH]\n");
+// Handle a packet received for the job.
+// Return "0" on success or "-1" on error.
+int receivePacket(RecvJob *job, unsigned char *packet, int packetSize){
+    if(job->stage == CTRL_START){
+        if(packet[0] != CTRL_START) return 0;   // not started yet, wait for START
+        printf("  -Receiving Control Field [START]\n");
+
+        unsigned char *name = NULL;
+        uint64_t hash;
+        int hashed;
+        job->fileSize = 0;
+        int parsed = parseCPacket(packet, packetSize, &job->fileSize, &name, &hash, &hashed);
+        free(name);
+        if(parsed < 0) return -1;
+        job->unsynced = 0;
+        hashInit(&job->hash, 0);
+
+        if(job->delta){
+            // The new file is built next to the old one, which blocks are copied from
+            if(sendSignatures(job) < 0) return -1;
+            snprintf(job->partName, sizeof(job->partName), "%s.part", job->filename);
+            job->file = fopen(job->partName, "wb+");
+        }
+        else job->file = fopen(job->filename, "wb+");
+        if(job->dedup){
+            job->stream = (unsigned char *) malloc(CDC_MAX);
+            job->streamLen = 0;
+            chunkerInit(&job->chunker);
+        }
+        job->stage = CTRL_DATA;
+        return 0;
+    }
+
+    if(packet[0] == CTRL_DATA){
+        printf("    -Receiving Data\n");
+        PROF_BEGIN(PROF_DISK_WRITE);
+        packetSize = (packet[1] << 8) + packet[2];
+        unsigned char *buf = (unsigned char*) malloc (packetSize);
+        memcpy(buf, packet + 3, packetSize);
+        fwrite(buf, sizeof(unsigned char), packetSize, job->file);
+        hashUpdate(&job->hash, buf, packetSize);
+        if(job->dedup) feedChunker(job, buf, packetSize);
+        free(buf);
+
+        // Syncing may stall on the disk, so pause the transmitter instead of letting it time out
+        job->unsynced += packetSize;
+        if(job->unsynced >= SYNC_SIZE){
+            llsetcredit(0);
+            fflush(job->file);
+            fsync(fileno(job->file));
+            llsetcredit(DEFAULT_CREDIT);
+            job->unsynced = 0;
+        }
+        PROF_END(PROF_DISK_WRITE);
+
+    } else if(packet[0] == CTRL_HOLE){
+        // Skip the zeros: the file system leaves a hole, or reads zeros where data was punched out
+        unsigned long length = 0;
+        for(int i = 0; i < packet[1] && i + 2 < packetSize; i++)
+            length = (length << 8) + packet[2 + i];
+        printf("    -Receiving Hole [%lu Bytes]\n", length);
+
+        PROF_BEGIN(PROF_DISK_WRITE);
+        fflush(job->file);
+        long pos = ftell(job->file);
+#ifdef FALLOC_FL_PUNCH_HOLE
+        fallocate(fileno(job->file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, length);
+#endif
+        fseek(job->file, pos + length, SEEK_SET);
+        hashZeros(&job->hash, length);
+        PROF_END(PROF_DISK_WRITE);
+
+    } else if(packet[0] == CTRL_COPY && packetSize >= 9 && job->oldFd >= 0){
+        long block = getBE(packet + 1, 4), count = getBE(packet + 5, 4);
+        printf("    -Receiving Copy [%ld Blocks]\n", count);
+
+        PROF_BEGIN(PROF_DISK_WRITE);
+        unsigned char *buf = (unsigned char*) malloc (job->blockSize);
+        for(long i = 0; i < count; i++){
+            if(pread(job->oldFd, buf, job->blockSize, (block + i) * job->blockSize) != job->blockSize){
+                PROF_END(PROF_DISK_WRITE);
+                printf("[ERROR - Couldnt Read Block From The Old File]\n");
+                free(buf);
+                return -1;
+            }
+            fwrite(buf, sizeof(unsigned char), job->blockSize, job->file);
+            hashUpdate(&job->hash, buf, job->blockSize);
+        }
+        free(buf);
+        PROF_END(PROF_DISK_WRITE);
+
+    } else if(packet[0] == CTRL_ASK && packetSize >= 9 && job->dedup){
+        if(answerChunks(packet, packetSize) < 0) return -1;
+
+    } else if(packet[0] == CTRL_CHUNK && packetSize >= 21 && job->dedup){
+        ChunkKey key = {getBE(packet + 1, 8), getBE(packet + 9, 8)};
+        int length = getBE(packet + 17, 4);
+        printf("    -Receiving Chunk Reference [%d Bytes]\n", length);
+
+        // A reference always starts a chunk of ours too, and is only sent for a chunk we said we have
+        unsigned char *buf = (unsigned char*) malloc (length > 0 ? length : 1);
+        if(job->streamLen != 0 || length > CDC_MAX || storeGet(key, buf, length) < 0){
+            printf("[ERROR - Chunk Missing From The Store]\n");
+            free(buf);
             return -1;
         }
+        PROF_BEGIN(PROF_DISK_WRITE);
+        fwrite(buf, sizeof(unsigned char), length, job->file);
+        hashUpdate(&job->hash, buf, length);
+        PROF_END(PROF_DISK_WRITE);
+        free(buf);
+
+    } else if(packet[0] == CTRL_END){
+        printf("  -Receiving Control Field [END]\n");
+        unsigned long int fileSizeEnd = 0;
+        unsigned char *nameEnd = NULL;
+        uint64_t hashEnd;
+        int hashed;
+        int parsed = parseCPacket(packet, packetSize, &fileSizeEnd, &nameEnd, &hashEnd, &hashed);
+        free(nameEnd);
+        if(parsed < 0) return -1;
+
+        if(job->fileSize != fileSizeEnd)
+            printf("[ERROR - START AND END CONTROL FRAMES DO NOT MATCH]\n");
+
+        // Hashed as it was written, so the file isn't read again
+        int intact = !hashed || hashDigest(&job->hash) == hashEnd;
+        if(hashed) printf(intact ? "  -Checking File Hash [OK]\n" : "[ERROR - FILE HASH DOES NOT MATCH]\n");
+
+        // A trailing hole was only skipped, give the file its full size
+        fflush(job->file);
+        ftruncate(fileno(job->file), ftell(job->file));
+        if(job->dedup && job->streamLen > 0) keepChunk(job->stream, job->streamLen);   // the last chunk ends with the file
+        closeRecvJob(job);
+
+        // A damaged copy doesn't replace the old one
+        if(job->delta && intact) rename(job->partName, job->filename);
+        job->stage = 0;
+        if(!intact) return -1;
+
+    } else{
+        printf("[ERROR - DATA PACKET DOESNT MATCH]\n");
+        return -1;
     }
 
-    fclose(newFile);
-    return packetSize;
+    return 0;
+}
+
+int receiverTasks(const char *filename){
+    unsigned char *packet = (unsigned char *) malloc (MAX_PAYLOAD_SIZE);
+    RecvJob job = {filename, NULL, 0, 0, CTRL_START, deltaMode(), -1};
+    job.dedup = !job.delta && dedupMode();
+
+    int result = 0;
+    while(job.stage != 0 && result == 0){
+        int packetSize;
+        while ((packetSize = llread(packet)) < 0);
+        result = packetSize == 0 ? -1 : receivePacket(&job, packet, packetSize);
+    }
+
+    closeRecvJob(&job);
+    free(packet);
+    return result;
+}
+
+// Send one file and receive another over the same link at the same time.
+// "filenames" is "<file to send>:<file to receive>".
+int duplexTasks(const char *filenames, int initiator){
+    char sendName[256], recvName[256];
+    const char *sep = strchr(filenames, ':');
+    if(sep == NULL || sep - filenames >= (long) sizeof(sendName) || strlen(sep + 1) >= sizeof(recvName)){
+        printf("[ERROR - Duplex filename must be <send>:<receive>]\n");
+        return -1;
+    }
+    memcpy(sendName, filenames, sep - filenames);
+    sendName[sep - filenames] = '\0';
+    strcpy(recvName, sep + 1);
+
+    SendJob send;
+    if(openSendJob(&send, sendName) < 0) return -1;
+    RecvJob recv = {recvName, NULL, 0, 0, CTRL_START, FALSE, -1};
+    unsigned char *packet = (unsigned char *) malloc (MAX_PAYLOAD_SIZE);
+
+    int result = 0;
+    while((send.stage != 0 || recv.stage != 0) && result == 0){
+        if(send.stage != 0) result = sendNext(&send);
+
+        // Frames that arrived while our own waited for its acknowledgement are queued.
+        // Block on the link only once there is nothing left to send.
+        while(result == 0 && recv.stage != 0 && (send.stage == 0 || llpending() > 0)){
+            int packetSize = llread(packet);
+            if(packetSize == 0){
+                printf("[ERROR - Peer disconnected]\n");
+                result = -1;
+            }
+            else if(packetSize > 0) result = receivePacket(&recv, packet, packetSize);
+        }
+    }
+
+    // The initiator closes the connection, the other side waits for its DISC
+    if(result == 0 && !initiator) while(llread(packet) != 0);
+
+    closeSendJob(&send);
+    closeRecvJob(&recv);
+    free(packet);
+    return result;
 }
 
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout, const char *filename){
+    // "mtx:<receivers>" / "mrx:<id>": one transmitter, several receivers on the fan-out cable
+    if(role[0] == 'm'){
+        const char *number = strchr(role, ':');
+        if(number == NULL || (strncmp(role, "mtx", 3) && strncmp(role, "mrx", 3))){
+            printf("[ERROR - Multicast role must be mtx:<receivers> or mrx:<id>]\n");
+            exit(-1);
+        }
+        printf("\n---- MULTICAST PROTOCOL ----\n");
+        int result = role[1] == 't' ? mcSend(serialPort, baudRate, atoi(number + 1), nTries, timeout, filename)
+                                    : mcReceive(serialPort, baudRate, atoi(number + 1), nTries, timeout, filename);
+        if(result < 0) printf("[ERROR WHILE TRANSFERRING - CLOSING]\n");
+        return;
+    }
+
     LinkLayer connectionParams = buildConnectionParams(serialPort, role, baudRate, nTries, timeout);
 
     int fd;
+    int duplex = strchr(role, '+') != NULL;    // "tx+rx" / "rx+tx": both sides send a file
+    llsetduplex(duplex || deltaMode() || dedupRequested());     // delta, dedup: the receiver answers the transmitter
+
+    // RCOM_FCS=crc16|crc32|crc32c asks the receiver for a CRC instead of the XOR BCC2
+    const char *fcs = getenv("RCOM_FCS");
+    if(fcs != NULL && llsetcheck(fcsType(fcs)) < 0)
+        printf("[ERROR - Unknown frame check %s, keeping xor]\n", fcs);
+
+    // RCOM_FRAMING=length drops byte stuffing on links that are 8-bit clean
+    const char *framing = getenv("RCOM_FRAMING");
+    if(framing != NULL && strcmp(framing, "length") == 0) llsetframing(TRUE);
 
     printf("\n---- OPEN PROTOCOL ----\n");
     if((fd = llopen(connectionParams)) < 0){
@@ -205,7 +1060,11 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
     }
 
     else{
-        if(connectionParams.role == LlTx){
+        if(duplex){
+            printf("\n---- DUPLEX PROTOCOL ----\n");
+            if(duplexTasks(filename, connectionParams.role == LlTx) < 0) printf("[ERROR WHILE TRANSFERRING - CLOSING]\n");
+        }
+        else if(connectionParams.role == LlTx){
             printf("\n---- WRITE PROTOCOL ----\n");
             if(trasmitterTasks(filename) < 0) printf("[ERROR WHILE WRITING - CLOSING]\n");
         }
@@ -220,6 +1079,7 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
             printf("[ERROR - llclose()]\n");
             exit(-1);
         }
+        PROF_REPORT(connectionParams.role == LlTx ? "tx" : "rx");
     }
 
 }
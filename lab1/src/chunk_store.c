@@ -0,0 +1,117 @@
+// Content-defined chunking and the chunk store
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "chunk_store.h"
+#include "hash.h"
+
+// Normalized chunking: a harder mask before CDC_AVG, an easier one after it,
+// so sizes cluster around CDC_AVG. High bits are used since the gear hash
+// shifts old bytes out to the left.
+#define MASK_HARD   (((1ULL << 15) - 1) << 49)
+#define MASK_EASY   (((1ULL << 11) - 1) << 53)
+
+static uint64_t gear[256];
+static int gearReady = 0;
+static char storeDir[512];
+
+// Same table on every host: splitmix64 from a fixed seed
+static void buildGear(){
+    uint64_t x = 0x5EED0F0C4A7C3A11ULL;
+    for(int i = 0; i < 256; i++){
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gearReady = 1;
+}
+
+void chunkerInit(Chunker *chunker){
+    if(!gearReady) buildGear();
+    chunker->fp = 0;
+    chunker->pos = 0;
+}
+
+int chunkerScan(Chunker *chunker, const unsigned char *buf, int len){
+    int end = len < CDC_MAX ? len : CDC_MAX;
+    int i = chunker->pos;
+    uint64_t fp = chunker->fp;
+
+    // Bytes before CDC_MIN can't end a chunk and don't need hashing
+    if(i < CDC_MIN) i = CDC_MIN < end ? CDC_MIN : end;
+
+    for(; i < end; i++){
+        fp = (fp << 1) + gear[buf[i]];
+        if(!(fp & (i < CDC_AVG ? MASK_HARD : MASK_EASY))){
+            chunkerInit(chunker);
+            return i + 1;
+        }
+    }
+
+    if(end == CDC_MAX){
+        chunkerInit(chunker);
+        return CDC_MAX;
+    }
+    chunker->fp = fp;
+    chunker->pos = end;
+    return 0;
+}
+
+ChunkKey chunkKey(const unsigned char *data, int len){
+    ChunkKey key = {xxh64(data, len, 0), xxh64(data, len, 1)};
+    return key;
+}
+
+int storeOpen(const char *dir){
+    if(strlen(dir) + 40 > sizeof(storeDir)) return -1;
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+        perror(dir);
+        return -1;
+    }
+    strcpy(storeDir, dir);
+    return 0;
+}
+
+static void chunkPath(ChunkKey key, char *path){
+    sprintf(path, "%s/%016llx%016llx", storeDir, (unsigned long long) key.hi, (unsigned long long) key.lo);
+}
+
+int storeHas(ChunkKey key){
+    char path[sizeof(storeDir) + 40];
+    chunkPath(key, path);
+    return access(path, F_OK) == 0;
+}
+
+int storePut(ChunkKey key, const unsigned char *data, int len){
+    char path[sizeof(storeDir) + 40], tmp[sizeof(storeDir) + 48];
+    chunkPath(key, path);
+    sprintf(tmp, "%s.tmp", path);
+
+    // Written aside and renamed, so a chunk in the store is always whole
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -1;
+    int written = write(fd, data, len);
+    close(fd);
+    if(written != len || rename(tmp, path) < 0){
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int storeGet(ChunkKey key, unsigned char *data, int len){
+    char path[sizeof(storeDir) + 40];
+    chunkPath(key, path);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+    int got = read(fd, data, len);
+    close(fd);
+    return got == len ? 0 : -1;
+}
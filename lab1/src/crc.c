@@ -0,0 +1,152 @@
+// Frame check sequences
+
+#include <string.h>
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SSE42_PATH
+#include <nmmintrin.h>
+#endif
+
+// Reflected polynomials
+#define POLY_CRC16      0x8408          // X-25 / HDLC
+#define POLY_CRC32      0xEDB88320
+#define POLY_CRC32C     0x82F63B78
+
+// table[k][b]: CRC of byte b followed by k zero bytes
+static uint32_t table16[8][256], table32[8][256], table32c[8][256];
+static int tablesReady = 0;
+static int hardware = 0;
+
+static void buildTable(uint32_t table[8][256], uint32_t poly){
+    for(int b = 0; b < 256; b++){
+        uint32_t crc = b;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        table[0][b] = crc;
+    }
+    for(int k = 1; k < 8; k++)
+        for(int b = 0; b < 256; b++)
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+}
+
+static void buildTables(){
+    buildTable(table16, POLY_CRC16);
+    buildTable(table32, POLY_CRC32);
+    buildTable(table32c, POLY_CRC32C);
+#ifdef HAVE_SSE42_PATH
+    hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    tablesReady = 1;
+}
+
+// Slicing-by-8 over a reflected CRC of up to 32 bits
+static uint32_t slice8(uint32_t table[8][256], uint32_t crc, const unsigned char *p, size_t n){
+    for(; n >= 8; p += 8, n -= 8){
+        uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+    for(; n > 0; p++, n--)
+        crc = table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef HAVE_SSE42_PATH
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *p, size_t n){
+#ifdef __x86_64__
+    for(; n >= 8; p += 8, n -= 8){
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = (uint32_t) _mm_crc32_u64(crc, w);
+    }
+#endif
+    for(; n >= 4; p += 4, n -= 4){
+        uint32_t w;
+        memcpy(&w, p, 4);
+        crc = _mm_crc32_u32(crc, w);
+    }
+    for(; n > 0; p++, n--)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+uint8_t xorCheck(const unsigned char *buf, size_t len){
+    uint64_t acc = 0;
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8){
+        uint64_t w;
+        memcpy(&w, buf + i, 8);
+        acc ^= w;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    uint8_t bcc = (uint8_t) acc;
+    for(; i < len; i++) bcc ^= buf[i];
+    return bcc;
+}
+
+uint16_t crc16(const unsigned char *buf, size_t len){
+    if(!tablesReady) buildTables();
+    return (uint16_t) (slice8(table16, 0xFFFF, buf, len) ^ 0xFFFF);
+}
+
+uint32_t crc32(const unsigned char *buf, size_t len){
+    if(!tablesReady) buildTables();
+    return slice8(table32, 0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+}
+
+uint32_t crc32cTable(const unsigned char *buf, size_t len){
+    if(!tablesReady) buildTables();
+    return slice8(table32c, 0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+}
+
+uint32_t crc32c(const unsigned char *buf, size_t len){
+    if(!tablesReady) buildTables();
+#ifdef HAVE_SSE42_PATH
+    if(hardware) return crc32cSse42(0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+#endif
+    return crc32cTable(buf, len);
+}
+
+int crc32cHardware(){
+    if(!tablesReady) buildTables();
+    return hardware;
+}
+
+int fcsSize(FCS_TYPE type){
+    switch(type){
+        case FCS_CRC16: return 2;
+        case FCS_CRC32:
+        case FCS_CRC32C: return 4;
+        default: return 1;
+    }
+}
+
+static const char *names[FCS_TYPES] = {"xor", "crc16", "crc32", "crc32c"};
+
+const char *fcsName(FCS_TYPE type){
+    return type < FCS_TYPES ? names[type] : "?";
+}
+
+int fcsType(const char *name){
+    for(int i = 0; i < FCS_TYPES; i++)
+        if(strcmp(name, names[i]) == 0) return i;
+    return -1;
+}
+
+void fcsCompute(FCS_TYPE type, const unsigned char *buf, int len, unsigned char *out){
+    uint32_t check;
+    switch(type){
+        case FCS_CRC16: check = crc16(buf, len); break;
+        case FCS_CRC32: check = crc32(buf, len); break;
+        case FCS_CRC32C: check = crc32c(buf, len); break;
+        default: check = xorCheck(buf, len); break;
+    }
+    for(int i = 0; i < fcsSize(type); i++)
+        out[i] = (check >> (8 * i)) & 0xFF;
+}
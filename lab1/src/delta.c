@@ -0,0 +1,203 @@
+// Block-signature delta encoding
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "delta.h"
+#include "hash.h"
+
+int deltaBlockSize(long fileSize){
+    long size = (long) sqrt((double) fileSize);
+    size = (size + 63) & ~63L;
+    if(size < DELTA_MIN_BLOCK) size = DELTA_MIN_BLOCK;
+    if(size > DELTA_MAX_BLOCK) size = DELTA_MAX_BLOCK;
+    return size;
+}
+
+// a: sum of the bytes, b: sum of the running sums, 16 bits each
+uint32_t weakChecksum(const unsigned char *buf, int len){
+    uint32_t a = 0, b = 0;
+    for(int i = 0; i < len; i++){
+        a += buf[i];
+        b += (uint32_t) (len - i) * buf[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+// Slide the window one byte: "out" leaves, "in" enters
+static uint32_t rollChecksum(uint32_t weak, unsigned char out, unsigned char in, int len){
+    uint32_t a = weak & 0xFFFF, b = weak >> 16;
+    a = (a - out + in) & 0xFFFF;
+    b = (b - (uint32_t) len * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+BlockSig blockSignature(const unsigned char *block, int len){
+    BlockSig sig = {weakChecksum(block, len), xxh64(block, len, 0)};
+    return sig;
+}
+
+int deltaInit(DeltaScan *scan, int fd, long size, int blockSize, const BlockSig *sigs, long blocks){
+    long slots = 1;
+    while(slots < 2 * blocks) slots <<= 1;
+
+    scan->table = (long *) calloc(slots, sizeof(long));
+    scan->buffer = (unsigned char *) malloc(DELTA_BUFFER);
+    if(scan->table == NULL || scan->buffer == NULL){
+        deltaFree(scan);
+        return -1;
+    }
+    scan->tableMask = slots - 1;
+
+    // Lowest block first, so runs of consecutive blocks are found from their start
+    for(long i = 0; i < blocks; i++){
+        long slot = sigs[i].weak & scan->tableMask;
+        while(scan->table[slot] != 0) slot = (slot + 1) & scan->tableMask;
+        scan->table[slot] = i + 1;
+    }
+
+    scan->fd = fd;
+    scan->size = size;
+    scan->bufferStart = scan->bufferLen = 0;
+    scan->blockSize = blockSize;
+    scan->sigs = sigs;
+    scan->blocks = blocks;
+    scan->pos = scan->literal = 0;
+    scan->weakValid = 0;
+    return 0;
+}
+
+const unsigned char *deltaData(const DeltaScan *scan, long offset){
+    return scan->buffer + (offset - scan->bufferStart);
+}
+
+// Make the bytes up to end resident. What was not handed out yet (from literal
+// on) is kept at the front of the buffer and the rest is read after it.
+// Return "0" on success or "-1" when end is past what the buffer or file holds.
+static int fill(DeltaScan *scan, long end){
+    if(end <= scan->bufferStart + scan->bufferLen) return 0;
+    if(end - scan->literal > DELTA_BUFFER) return -1;
+
+    long keep = scan->bufferStart + scan->bufferLen - scan->literal;
+    memmove(scan->buffer, deltaData(scan, scan->literal), keep);
+    scan->bufferStart = scan->literal;
+    scan->bufferLen = keep;
+
+    while(scan->bufferLen < DELTA_BUFFER && scan->bufferStart + scan->bufferLen < scan->size){
+        long want = scan->size - (scan->bufferStart + scan->bufferLen);
+        if(want > DELTA_BUFFER - scan->bufferLen) want = DELTA_BUFFER - scan->bufferLen;
+        long got = pread(scan->fd, scan->buffer + scan->bufferLen, want, scan->bufferStart + scan->bufferLen);
+        if(got <= 0) return -1;
+        scan->bufferLen += got;
+    }
+    return end <= scan->bufferStart + scan->bufferLen ? 0 : -1;
+}
+
+// Old block matching the window, or -1
+static long findBlock(DeltaScan *scan){
+    if(scan->blocks == 0) return -1;
+
+    uint64_t strong = 0;
+    int strongValid = 0;
+    for(long slot = scan->weak & scan->tableMask; scan->table[slot] != 0; slot = (slot + 1) & scan->tableMask){
+        long block = scan->table[slot] - 1;
+        if(scan->sigs[block].weak != scan->weak) continue;
+
+        if(!strongValid){
+            strong = xxh64(deltaData(scan, scan->pos), scan->blockSize, 0);
+            strongValid = 1;
+        }
+        if(scan->sigs[block].strong == strong) return block;
+    }
+    return -1;
+}
+
+int deltaNext(DeltaScan *scan, long maxLiteral, DeltaOp *op){
+    int B = scan->blockSize;
+    if(maxLiteral > DELTA_BUFFER - B - 1) maxLiteral = DELTA_BUFFER - B - 1;   // The run and the window fit in the buffer
+
+    while(scan->pos + B <= scan->size){
+        // The window, and the byte that enters it next
+        if(fill(scan, scan->pos + B < scan->size ? scan->pos + B + 1 : scan->size) < 0) return -1;
+
+        if(scan->pos - scan->literal >= maxLiteral){
+            op->type = DELTA_LITERAL;
+            op->offset = scan->literal;
+            op->length = scan->pos - scan->literal;
+            scan->literal = scan->pos;
+            return 1;
+        }
+
+        if(!scan->weakValid){
+            scan->weak = weakChecksum(deltaData(scan, scan->pos), B);
+            scan->weakValid = 1;
+        }
+
+        long block = findBlock(scan);
+        if(block >= 0){
+            // The bytes before the match go first; the match is found again on the next call
+            if(scan->pos > scan->literal){
+                op->type = DELTA_LITERAL;
+                op->offset = scan->literal;
+                op->length = scan->pos - scan->literal;
+                scan->literal = scan->pos;
+                return 1;
+            }
+
+            // Extend over the blocks that follow it in the old file too, as far as the buffer holds
+            long count = 1;
+            scan->pos += B;
+            while(scan->pos + B <= scan->size && block + count < scan->blocks && fill(scan, scan->pos + B) == 0 &&
+                  xxh64(deltaData(scan, scan->pos), B, 0) == scan->sigs[block + count].strong){
+                count++;
+                scan->pos += B;
+            }
+
+            op->type = DELTA_COPY;
+            op->block = block;
+            op->count = count;
+            scan->literal = scan->pos;
+            scan->weakValid = 0;
+            return 1;
+        }
+
+        if(scan->pos + B < scan->size)
+            scan->weak = rollChecksum(scan->weak, *deltaData(scan, scan->pos), *deltaData(scan, scan->pos + B), B);
+        else scan->weakValid = 0;
+        scan->pos++;
+    }
+
+    // Tail shorter than a block
+    if(scan->literal < scan->size){
+        long length = scan->size - scan->literal;
+        op->type = DELTA_LITERAL;
+        op->offset = scan->literal;
+        op->length = length < maxLiteral ? length : maxLiteral;
+        if(fill(scan, op->offset + op->length) < 0) return -1;
+        scan->literal += op->length;
+        if(scan->pos < scan->literal) scan->pos = scan->literal;
+        return 1;
+    }
+    return 0;
+}
+
+void deltaFree(DeltaScan *scan){
+    free(scan->table);
+    free(scan->buffer);
+    scan->table = NULL;
+    scan->buffer = NULL;
+}
+
+void putBE(unsigned char *p, uint64_t value, int bytes){
+    for(int i = bytes - 1; i >= 0; i--){
+        p[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+uint64_t getBE(const unsigned char *p, int bytes){
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++) value = (value << 8) | p[i];
+    return value;
+}
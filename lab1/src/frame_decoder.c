@@ -0,0 +1,336 @@
+// Frame codec: specialized encoders and the table-driven frame decoder
+
+#include <stdint.h>
+#include <string.h>
+#include "frame_decoder.h"
+#include "link_layer.h"
+#include "profile.h"
+#include "utils.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Byte classes */
+#define CLASS_OTHER 0
+#define CLASS_FLAG  1
+#define CLASS_ESC   2
+#define CLASSES     3
+
+/* Kinds of C field */
+#define C_INVALID   0
+#define C_I         1   // Payload follows BCC1
+#define C_S         2   // FLAG follows BCC1
+#define C_S_CREDIT  3   // Credit byte, then BCC1
+
+/* Actions run on a transition */
+typedef enum {
+    ACT_NONE,
+    ACT_A,          // Store the address
+    ACT_C,          // Store the control field, drop unknown ones
+    ACT_HEADER,     // Byte after C: credit or BCC1
+    ACT_BCC1,       // BCC1 after a credit byte
+    ACT_S_END,      // Closing FLAG of an S/U frame
+    ACT_I_END,      // Closing FLAG of an I frame
+    ACT_DATA,       // Payload byte (runs are taken in bulk before reaching the table)
+    ACT_UNSTUFF,    // Byte after ESC_B1
+    ACT_BAD,        // Stuffing error
+} ACTION;
+
+typedef struct {
+    unsigned char next;
+    unsigned char action;
+} Transition;
+
+// dfa[state][class]
+static const Transition dfa[BYTE_STUFF + 1][CLASSES] = {
+    [START]      = {{START, ACT_NONE},        {FLAG_RCV, ACT_NONE},  {START, ACT_NONE}},
+    [FLAG_RCV]   = {{A_RCV, ACT_A},           {FLAG_RCV, ACT_NONE},  {START, ACT_NONE}},
+    [A_RCV]      = {{C_RCV, ACT_C},           {FLAG_RCV, ACT_NONE},  {START, ACT_NONE}},
+    [C_RCV]      = {{START, ACT_HEADER},      {FLAG_RCV, ACT_NONE},  {START, ACT_HEADER}},
+    [CREDIT_RCV] = {{START, ACT_BCC1},        {FLAG_RCV, ACT_NONE},  {START, ACT_BCC1}},
+    [BCC1_RCV]   = {{START, ACT_NONE},        {FLAG_RCV, ACT_S_END}, {START, ACT_NONE}},
+    [READING]    = {{READING, ACT_DATA},      {FLAG_RCV, ACT_I_END}, {BYTE_STUFF, ACT_NONE}},
+    [BYTE_STUFF] = {{READING, ACT_UNSTUFF},   {FLAG_RCV, ACT_I_END}, {READING, ACT_BAD}},
+};
+
+static unsigned char byteClass[256];
+static unsigned char cKind[256];
+static unsigned char escapeOf[256];     // Second byte of the escape sequence, 0 when the byte goes out as is
+static int tablesReady = FALSE;
+
+static void buildTables(){
+    byteClass[FLAG] = CLASS_FLAG;
+    byteClass[ESC_B1] = CLASS_ESC;
+    escapeOf[FLAG] = ESC_B2;
+    escapeOf[ESC_B1] = ESC_B3;
+
+    // N(S), N(R) and the aggregation bit in any combination
+    for(int c = 0; c < 256; c++)
+        if((c & ~(CI_1 | NR_BIT | AGG_BIT)) == 0) cKind[c] = C_I;
+    cKind[SET] = cKind[UA] = cKind[DISC] = C_S;
+    cKind[RR0] = cKind[RR1] = cKind[REJ0] = cKind[REJ1] = cKind[RNR0] = cKind[RNR1] = C_S;
+    cKind[RR0 | CREDIT] = cKind[RR1 | CREDIT] = C_S_CREDIT;
+    cKind[SET | OPTIONS] = cKind[UA | OPTIONS] = C_S_CREDIT;
+
+    tablesReady = TRUE;
+}
+
+// Length of the run of bytes that are neither FLAG nor ESC_B1.
+static int escapeFreeRun(const unsigned char *p, int n){
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i flag = _mm_set1_epi8((char) FLAG), esc = _mm_set1_epi8((char) ESC_B1);
+    for(; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if(mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    while(i < n && byteClass[p[i]] == CLASS_OTHER) i++;
+    return i;
+}
+
+// Write b, stuffed, to out (room for 2 bytes). Return the number of bytes written.
+static inline int stuffByte(unsigned char b, unsigned char *out){
+    unsigned char e = escapeOf[b];
+    out[0] = e ? ESC_B1 : b;
+    out[1] = e;
+    return 1 + (e != 0);
+}
+
+static int encodeHeader(unsigned char A, unsigned char C, unsigned char *out){
+    out[0] = FLAG;
+    out[1] = A;
+    out[2] = C;
+    out[3] = A ^ C;
+    return 4;
+}
+
+static int encodeRawHeader(unsigned char A, unsigned char C, int size, unsigned char *out){
+    out[0] = FLAG;
+    out[1] = A;
+    out[2] = C;
+    out[3] = size;
+    out[4] = size >> 8;
+    uint16_t hcs = crc16(out + 1, 4);
+    out[5] = hcs;
+    out[6] = hcs >> 8;
+    return 7;
+}
+
+// Byte i of the frame: payload first, then the bytes past capacity
+static unsigned char frameByte(const FrameDecoder *d, int i){
+    return i < d->size ? d->payload[i] : d->spillBytes[i - d->size];
+}
+
+#define CODEC_CHECK 0
+#define CODEC_NAME(f) f##Xor
+#include "codec_variant.h"
+
+#define CODEC_CHECK 1
+#define CODEC_NAME(f) f##Crc16
+#include "codec_variant.h"
+
+#define CODEC_CHECK 2
+#define CODEC_NAME(f) f##Crc32
+#include "codec_variant.h"
+
+#define CODEC_CHECK 3
+#define CODEC_NAME(f) f##Crc32c
+#include "codec_variant.h"
+
+// codecs[raw][fcs]: byte stuffed, then length-prefixed
+static const FrameCodec codecs[2][FCS_TYPES] = {{
+    [FCS_XOR]    = {FCS_XOR,    1, FALSE, encodeSmallXor,    encodeBulkXor,    copyRunXor,    checkFrameXor},
+    [FCS_CRC16]  = {FCS_CRC16,  2, FALSE, encodeSmallCrc16,  encodeBulkCrc16,  copyRunCrc16,  checkFrameCrc16},
+    [FCS_CRC32]  = {FCS_CRC32,  4, FALSE, encodeSmallCrc32,  encodeBulkCrc32,  copyRunCrc32,  checkFrameCrc32},
+    [FCS_CRC32C] = {FCS_CRC32C, 4, FALSE, encodeSmallCrc32c, encodeBulkCrc32c, copyRunCrc32c, checkFrameCrc32c},
+}, {
+    [FCS_XOR]    = {FCS_XOR,    1, TRUE,  encodeRawXor,      encodeRawXor,      copyRunXor,    checkFrameXor},
+    [FCS_CRC16]  = {FCS_CRC16,  2, TRUE,  encodeRawCrc16,    encodeRawCrc16,    copyRunCrc16,  checkFrameCrc16},
+    [FCS_CRC32]  = {FCS_CRC32,  4, TRUE,  encodeRawCrc32,    encodeRawCrc32,    copyRunCrc32,  checkFrameCrc32},
+    [FCS_CRC32C] = {FCS_CRC32C, 4, TRUE,  encodeRawCrc32c,   encodeRawCrc32c,   copyRunCrc32c, checkFrameCrc32c},
+}};
+
+const FrameCodec *frameCodec(FCS_TYPE fcs, int raw){
+    if(!tablesReady) buildTables();
+    return &codecs[raw ? 1 : 0][fcs];
+}
+
+int codecEncode(const FrameCodec *codec, unsigned char A, unsigned char C, const unsigned char *payload, int size, unsigned char *out){
+    if(size <= SMALL_PAYLOAD) return codec->encodeSmall(A, C, payload, size, out);
+    return codec->encodeBulk(A, C, payload, size, out);
+}
+
+int encodeFrame(unsigned char A, unsigned char C, const unsigned char *payload, int size, FCS_TYPE fcs, unsigned char *out){
+    return codecEncode(frameCodec(fcs, FALSE), A, C, payload, size, out);
+}
+
+static void storeByte(FrameDecoder *d, unsigned char b){
+    d->codec->copyRun(d, &b, 1);
+}
+
+void decoderInit(FrameDecoder *d){
+    if(!tablesReady) buildTables();
+    memset(d, 0, sizeof(*d));
+    d->state = START;
+    d->codec = &codecs[0][FCS_XOR];
+}
+
+void decoderSetCodec(FrameDecoder *d, const FrameCodec *codec){
+    d->codec = codec;
+}
+
+void decoderSetCheck(FrameDecoder *d, FCS_TYPE fcs){
+    decoderSetCodec(d, frameCodec(fcs, FALSE));
+}
+
+void decoderSetPayload(FrameDecoder *d, unsigned char *payload, int capacity){
+    // A payload half written into another buffer can't be finished here
+    if(d->payload != payload && (d->state == READING || d->state == BYTE_STUFF || d->state == RAW_DATA || d->state == RAW_END))
+        d->state = START;
+    d->payload = payload;
+    d->capacity = payload == NULL ? 0 : capacity;
+}
+
+static void startPayload(FrameDecoder *d){
+    d->size = 0;
+    d->spill = 0;
+    d->bad = FALSE;
+    d->bcc2 = 0;
+}
+
+// Length and header check of a length-prefixed frame are in: check them and
+// set how many payload and frame check bytes follow.
+static void startRawData(FrameDecoder *d){
+    unsigned char header[4] = {d->a, d->c, d->header[0], d->header[1]};
+    uint16_t hcs = crc16(header, 4);
+    if(d->header[2] != (hcs & 0xFF) || d->header[3] != hcs >> 8){
+        d->state = START;
+        return;
+    }
+    d->remaining = (d->header[0] | d->header[1] << 8) + d->codec->checkSize;
+    d->state = RAW_DATA;
+    startPayload(d);
+}
+
+// Describe the I frame that just ended in frame
+static void endIFrame(const FrameDecoder *d, int valid, Frame *frame){
+    int total = d->size + d->spill;
+    frame->kind = valid ? FRAME_I : FRAME_BAD;
+    frame->a = d->a;
+    frame->c = d->c;
+    frame->credit = 0;
+    frame->size = valid ? total - d->codec->checkSize : 0;
+}
+
+int decodeFrame(FrameDecoder *d, const unsigned char *in, int n, Frame *frame){
+    frame->kind = FRAME_NONE;
+    int i = 0;
+
+    while(i < n){
+        if(d->state == START){
+            const unsigned char *flag = memchr(in + i, FLAG, n - i);
+            if(flag == NULL) return n;
+            i = flag - in;
+        }
+        else if(d->state == READING && byteClass[in[i]] == CLASS_OTHER){
+            int run = escapeFreeRun(in + i, n - i);
+            d->codec->copyRun(d, in + i, run);
+            i += run;
+            continue;
+        }
+        else if(d->state == RAW_HEADER){
+            d->header[d->headerSize++] = in[i++];
+            if(d->headerSize == RAW_HEADER_SIZE) startRawData(d);
+            continue;
+        }
+        else if(d->state == RAW_DATA){
+            int take = n - i < d->remaining ? n - i : d->remaining;
+            d->codec->copyRun(d, in + i, take);
+            i += take;
+            d->remaining -= take;
+            if(d->remaining == 0) d->state = RAW_END;
+            continue;
+        }
+        else if(d->state == RAW_END){
+            // Anything but a FLAG here means bytes were lost: the frame is bad
+            int closed = in[i++] == FLAG;
+            d->state = closed ? FLAG_RCV : START;
+            PROF_BEGIN(PROF_BCC_CHECK);
+            int valid = closed && !d->bad && d->codec->checkFrame(d, d->size + d->spill);
+            PROF_END(PROF_BCC_CHECK);
+            endIFrame(d, valid, frame);
+            return i;
+        }
+
+        unsigned char b = in[i++];
+        STATE prev = d->state;
+        Transition t = dfa[prev][byteClass[b]];
+        d->state = t.next;
+
+        switch(t.action){
+            case ACT_A:
+                d->a = b;
+                break;
+            case ACT_C:
+                d->c = b;
+                d->credit = 0;
+                if(cKind[b] == C_INVALID) d->state = START;
+                else if(cKind[b] == C_I && d->codec->raw){
+                    d->state = RAW_HEADER;
+                    d->headerSize = 0;
+                }
+                break;
+            case ACT_HEADER:
+                if(cKind[d->c] == C_S_CREDIT){
+                    if(b <= MAX_CREDIT){
+                        d->credit = b;
+                        d->state = CREDIT_RCV;
+                    }
+                }
+                else if(b == (d->a ^ d->c)){
+                    if(cKind[d->c] == C_S) d->state = BCC1_RCV;
+                    else{
+                        d->state = READING;
+                        startPayload(d);
+                    }
+                }
+                break;
+            case ACT_BCC1:
+                if(b == (d->a ^ d->c ^ d->credit)) d->state = BCC1_RCV;
+                break;
+            case ACT_S_END:
+                frame->kind = FRAME_S;
+                frame->a = d->a;
+                frame->c = d->c;
+                frame->credit = d->credit;
+                frame->size = 0;
+                return i;
+            case ACT_I_END:{
+                PROF_BEGIN(PROF_BCC_CHECK);
+                int total = d->size + d->spill;
+                int valid = !d->bad && total >= d->codec->checkSize && prev != BYTE_STUFF && d->codec->checkFrame(d, total);
+                PROF_END(PROF_BCC_CHECK);
+                endIFrame(d, valid, frame);
+                return i;
+            }
+            case ACT_DATA:
+                storeByte(d, b);
+                break;
+            case ACT_UNSTUFF:
+                if(b == ESC_B2) storeByte(d, FLAG);
+                else if(b == ESC_B3) storeByte(d, ESC_B1);
+                else d->bad = TRUE;
+                break;
+            case ACT_BAD:
+                d->bad = TRUE;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return i;
+}
@@ -0,0 +1,119 @@
+// xxHash64 implementation
+
+#include <string.h>
+#include "hash.h"
+
+#define PRIME1  0x9E3779B185EBCA87ULL
+#define PRIME2  0xC2B2AE3D27D4EB4FULL
+#define PRIME3  0x165667B19E3779F9ULL
+#define PRIME4  0x85EBCA77C2B2AE63ULL
+#define PRIME5  0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads, whatever the host order
+static uint64_t read64(const unsigned char *p){
+    uint64_t v = 0;
+    for(int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p){
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input){
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t val){
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+static void stripe(HashState *state, const unsigned char *p){
+    for(int i = 0; i < 4; i++)
+        state->v[i] = round64(state->v[i], read64(p + 8 * i));
+}
+
+void hashInit(HashState *state, uint64_t seed){
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME1 + PRIME2;
+    state->v[1] = seed + PRIME2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME1;
+}
+
+void hashUpdate(HashState *state, const void *data, size_t len){
+    const unsigned char *p = (const unsigned char *) data;
+    state->total += len;
+
+    if(state->memSize + len < 32){
+        memcpy(state->mem + state->memSize, p, len);
+        state->memSize += len;
+        return;
+    }
+
+    if(state->memSize > 0){
+        int fill = 32 - state->memSize;
+        memcpy(state->mem + state->memSize, p, fill);
+        stripe(state, state->mem);
+        p += fill;
+        len -= fill;
+        state->memSize = 0;
+    }
+
+    for(; len >= 32; p += 32, len -= 32)
+        stripe(state, p);
+
+    memcpy(state->mem, p, len);
+    state->memSize = len;
+}
+
+uint64_t hashDigest(const HashState *state){
+    uint64_t h;
+
+    if(state->total >= 32){
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        for(int i = 0; i < 4; i++)
+            h = mergeRound(h, state->v[i]);
+    }
+    else h = state->seed + PRIME5;
+    h += state->total;
+
+    const unsigned char *p = state->mem;
+    int len = state->memSize;
+    for(; len >= 8; p += 8, len -= 8){
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if(len >= 4){
+        h ^= (uint64_t) read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for(; len > 0; p++, len--){
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed){
+    HashState state;
+    hashInit(&state, seed);
+    hashUpdate(&state, data, len);
+    return hashDigest(&state);
+}
@@ -10,6 +10,10 @@
 #include <termios.h>
 #include <unistd.h>
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "crc.h"
+#include "frame_decoder.h"
+#include "profile.h"
 #include "utils.h"
 
 
@@ -19,18 +23,53 @@
 LinkLayer connParams;
 
 struct termios oldtio;
-int fd;
-unsigned char byte;
+int fd = -1;
 
-volatile int STOP = FALSE;
 int alarmTriggered = FALSE;
 
-int frameNumTx = 0;
-int frameNumRx = 1;
+FrameDecoder decoder;
+unsigned char rxBuffer[RX_BUF_SIZE];    // Bytes read from the port and not yet decoded
+int rxStart = 0, rxEnd = 0;
+
+int frameNumTx = 0;     // Number of our next / outstanding information frame
+int recvNum = 0;        // Number of the information frame we expect from the peer
+
+unsigned char myAddr = AT, peerAddr = AR;   // Address of the frames each side sends
+
+// Full-duplex mode: both sides send information frames, acknowledgements are piggybacked
+int duplex = FALSE;
+int ackPending = FALSE;     // A frame was accepted and its acknowledgement waits for our next frame
+int rnrSent = FALSE;        // The peer was last told we have no credit
+int discReceived = FALSE;   // llread returned the peer's DISC
+
+// Duplex: frames received while we wait for our own acknowledgements, until llread takes them
+unsigned char rxQueue[RX_QUEUE][MAX_PAYLOAD_SIZE];
+int rxQueueSize[RX_QUEUE];
+int rxQueueAgg[RX_QUEUE];
+int rxHead = 0, rxQueued = 0;
+
+// Aggregation: packets given to llqueue wait in aggOut until they fill a frame, and llread
+// hands out the packets of an aggregated frame from aggIn one call at a time
+unsigned char aggOut[MAX_PAYLOAD_SIZE];
+int aggOutSize = 0, aggOutCount = 0;
+unsigned char aggIn[MAX_PAYLOAD_SIZE];
+int aggInSize = 0, aggInPos = 0;
 
 int totalPackets = 0;
 int packetsReceived = 0;
 int packetsRejected = 0;
+int packetsDeferred = 0;
+
+int peerCredit = DEFAULT_CREDIT;    // Frames the receiver told us it can take
+int localCredit = DEFAULT_CREDIT;   // Frames we (receiver) advertise we can take
+unsigned char lastCredit = 0;       // Credit carried by the last RR/RNR read
+unsigned char lastOptions = 0;      // Options carried by the last SET/UA read
+
+FCS_TYPE requestedCheck = FCS_XOR;  // Frame check the transmitter asks for in SET
+FCS_TYPE frameCheck = FCS_XOR;      // Frame check of the I frames, agreed at llopen
+int requestedRaw = FALSE;           // Length-prefixed framing asked for in SET
+int rawFraming = FALSE;             // Length-prefixed I frames, agreed at llopen
+const FrameCodec *codec = NULL;     // Codec of that check and framing, picked once at llopen
 
 int set_fd(LinkLayer conParam){
 
@@ -59,8 +98,8 @@ int set_fd(LinkLayer conParam){
 
     // Set input mode (non-canonical, no echo,...)
     newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 0; // Inter-character timer unused
-    newtio.c_cc[VMIN] = 0;  // Blocking read until 5 chars received
+    newtio.c_cc[VTIME] = 1; // Return after 0.1 s without input instead of spinning
+    newtio.c_cc[VMIN] = 0;  // Return as soon as any byte is available
 
     // VTIME e VMIN should be changed in order to protect with a
     // timeout the reception of the following character(s)
@@ -87,124 +126,235 @@ int sendSFrame(unsigned char A, unsigned char C){
     return write(fd, buffer, 5);
 }
 
-void readSFrame(STATE *state, unsigned char A, unsigned char C){
-    switch (*state){
-        case START:
-            if(byte == FLAG) *state = FLAG_RCV;
-            break;
-        case FLAG_RCV:
-            if(byte == A) *state = A_RCV;
-            else if (byte != FLAG) *state = START;
-            break;
-        case A_RCV:
-            if(byte == C) *state = C_RCV;
-            else if(byte == FLAG) *state = FLAG_RCV;
-            else state = START;
-            break;
-        case C_RCV:
-            if(byte == (A ^ C)) *state = BCC1_RCV;
-            else if (byte == FLAG) *state = FLAG_RCV;
-            else state = START;
-            break;
-        case BCC1_RCV:
-            if(byte == FLAG) STOP = TRUE;
-            else state = START;
-        default:
-            break;
+// Supervision frame carrying one more byte after C (credit or options), covered by BCC1.
+int sendSFrameValue(unsigned char A, unsigned char C, unsigned char value){
+    unsigned char buffer[6] = {FLAG, A, C, value, A ^ C ^ value, FLAG};
+    return write(fd, buffer, 6);
+}
+
+// Options byte of SET/UA
+unsigned char optionsByte(FCS_TYPE check, int raw){
+    return check | (raw ? RAW_FRAMING : 0);
+}
+
+// Answer the transmitter's SET with the options we agreed to (a plain UA when there are none).
+int sendUA(){
+    unsigned char options = optionsByte(frameCheck, rawFraming);
+    if(options == 0) return sendSFrame(AR, UA);
+    return sendSFrameValue(AR, UA | OPTIONS, options);
+}
+
+// Take the options of the SET/UA just read: frame check and framing of the I frames.
+void applyOptions(){
+    frameCheck = lastOptions & FCS_MASK;
+    rawFraming = (lastOptions & RAW_FRAMING) != 0;
+    codec = frameCodec(frameCheck, rawFraming);
+    decoderSetCodec(&decoder, codec);
+}
+
+// Credit we can advertise. In duplex mode it is also bounded by the free queue slots.
+int currentCredit(){
+    if(duplex && RX_QUEUE - rxQueued < localCredit)
+        return RX_QUEUE - rxQueued;
+    return localCredit;
+}
+
+// Advertise the receiver state: RR with the current credit, or RNR when there is none.
+// "next" is the number of the information frame the receiver expects.
+int sendReady(int next){
+    int credit = currentCredit();
+    ackPending = FALSE;
+    rnrSent = credit == 0;
+    if(credit == 0)
+        return sendSFrame(myAddr, next == 0 ? RNR0 : RNR1);
+
+    return sendSFrameValue(myAddr, (next == 0 ? RR0 : RR1) | CREDIT, credit);
+}
+
+// Check an information frame from the peer against the number we expect. Duplicates are
+// acknowledged again and bad frames rejected here; an accepted frame is left for the caller
+// to acknowledge.
+// Return "1" when the frame is accepted, "0" when it is dropped or "-1" when it is rejected.
+int checkIFrame(const Frame *frame){
+    int ns = (frame->c & CI_1) ? 1 : 0;
+
+    if(ns != recvNum){
+        // Retransmission of a frame already accepted: our acknowledgement was lost
+        if(frame->kind == FRAME_I) sendReady(recvNum);
+        return 0;
+    }
+    if(duplex && rxQueued == RX_QUEUE){
+        // No room: the RNR tells the peer to hold it until llread frees a slot
+        sendReady(recvNum);
+        return 0;
+    }
+    if(frame->kind == FRAME_BAD){
+        printf("[Error - Rejected Package]\n");
+        sendSFrame(myAddr, recvNum == 0 ? REJ0 : REJ1);
+        packetsRejected++;
+        totalPackets++;
+        return -1;
+    }
+
+    recvNum = recvNum == 0 ? 1 : 0;
+    packetsReceived++;
+    totalPackets++;
+    return 1;
+}
+
+// Duplex: queue slot the next information frame is decoded into (NULL when the queue is full).
+unsigned char *queueSlot(){
+    return rxQueued == RX_QUEUE ? NULL : rxQueue[(rxHead + rxQueued) % RX_QUEUE];
+}
+
+// Duplex: check a frame decoded into queueSlot() and keep it if accepted.
+// The acknowledgement is deferred to our next frame when "piggyback" is set and there is room left.
+// Return "1" when the frame was queued.
+int queueIFrame(const Frame *frame, int piggyback){
+    if(checkIFrame(frame) <= 0) return 0;
+
+    rxQueueSize[(rxHead + rxQueued) % RX_QUEUE] = frame->size;
+    rxQueueAgg[(rxHead + rxQueued) % RX_QUEUE] = (frame->c & AGG_BIT) != 0;
+    rxQueued++;
+    if(piggyback && currentCredit() > 0) ackPending = TRUE;
+    else sendReady(recvNum);
+    return 1;
+}
+
+// Read from the port until a complete frame is decoded. I frame payloads are written
+// to payload (at most capacity bytes, NULL drops them).
+// When timed, give up once the alarm fires.
+// Return "1" with the frame described in frame, or "0" on timeout.
+int readFrame(Frame *frame, unsigned char *payload, int capacity, int timed){
+    decoderSetPayload(&decoder, payload, capacity);
+
+    while(TRUE){
+        if(rxStart < rxEnd){
+            PROF_BEGIN(PROF_DEFRAME);
+            rxStart += decodeFrame(&decoder, rxBuffer + rxStart, rxEnd - rxStart, frame);
+            PROF_END(PROF_DEFRAME);
+            if(frame->kind != FRAME_NONE) return 1;
+        }
+        if(timed && alarmTriggered == TRUE) return 0;
+
+        PROF_BEGIN(PROF_READ);
+        int bytes = read(fd, rxBuffer, RX_BUF_SIZE);
+        PROF_END(PROF_READ);
+        if(bytes > 0){
+            rxStart = 0;
+            rxEnd = bytes;
+        }
+    }
+}
+
+// Wait for the supervision frame (A, C), skipping any other frame.
+// A SET/UA may carry options, which are left in lastOptions.
+// Return "1" when it arrives or "0" on timeout.
+int waitSFrame(unsigned char A, unsigned char C, int timed){
+    Frame frame;
+    while(readFrame(&frame, NULL, 0, timed)){
+        if(frame.kind == FRAME_S && frame.a == A && (frame.c & ~OPTIONS) == C){
+            lastOptions = (frame.c & OPTIONS) ? frame.credit : 0;
+            return 1;
+        }
     }
+    return 0;
 }
 
+// Read a supervision frame sent by the receiver (RR, REJ or RNR).
+// The credit it carries is left in lastCredit and the credit bit is cleared from the returned C.
+// In duplex mode information frames from the peer are queued meanwhile, and one whose N(R)
+// acknowledges our frame is returned as the matching RR.
 unsigned char readCFrame(){
-    STATE state = START;
-    STOP = FALSE;
-    unsigned char c = 0;
-    while(STOP == FALSE && alarmTriggered == FALSE){
-        if(read(fd, &byte, 1) > 0){
-            switch(state){
-                case START:
-                    if(byte == FLAG) state = FLAG_RCV;
-                    break;
-                case FLAG_RCV:
-                    if(byte == AR) state = A_RCV;
-                    else if(byte != FLAG) state = START;
-                    break;
-                case A_RCV:
-                    if(byte == RR0 || byte == RR1 || byte == REJ0 || byte == REJ1){
-                        c = byte;
-                        state = C_RCV;
-                    }
-                    else if(byte == FLAG) state = FLAG_RCV;
-                    else state = START;
-                    break;
-                case C_RCV:
-                    if(byte == (AR ^ c)) state = BCC1_RCV;
-                    else if(byte == FLAG) state = FLAG_RCV;
-                    else state = START;
-                    break;
-                case BCC1_RCV:
-                    if(byte == FLAG) STOP = TRUE;
-                    else state = START;
-                    break;
-                default:
-                    break;
-            }
+    Frame frame;
+    while(readFrame(&frame, duplex ? queueSlot() : NULL, duplex ? MAX_PAYLOAD_SIZE : 0, TRUE)){
+        if(frame.a != peerAddr) continue;
+
+        if(frame.kind == FRAME_S && (frame.c & ~OPTIONS) == SET && connParams.role == LlRx){
+            sendUA();     // our UA was lost
+            continue;
+        }
+
+        if(frame.kind != FRAME_S){
+            if(!duplex) continue;
+
+            // Our next frame can leave right away when this one acknowledges the current one,
+            // so its acknowledgement rides on it. Otherwise answer now: the peer may be waiting on us.
+            int nr = (frame.c & NR_BIT) ? 1 : 0;
+            int acked = frame.kind == FRAME_I && nr != frameNumTx;
+            queueIFrame(&frame, acked);
+            if(!acked) continue;
+
+            lastCredit = DEFAULT_CREDIT;
+            return nr == 0 ? RR0 : RR1;
         }
+
+        unsigned char c = frame.c & ~CREDIT;
+        if(c != RR0 && c != RR1 && c != REJ0 && c != REJ1 && c != RNR0 && c != RNR1) continue;
+
+        if(frame.c & CREDIT) lastCredit = frame.credit;
+        else if(c == RNR0 || c == RNR1) lastCredit = 0;
+        else lastCredit = DEFAULT_CREDIT;
+        return c;
     }
-    return c;
+    return 0;
 }
 
 void alarmHandler(int signal){
     alarmTriggered = TRUE;
 }
 
-int testConnection_Tx(STATE *state, int retransmissions, int timeout){
+int testConnection_Tx(int retransmissions, int timeout){
     (void) signal(SIGALRM, alarmHandler);
-    int retry = retransmissions;
-    while(retry != 0 && STOP == FALSE){
+    int retry = retransmissions, connected = FALSE;
+    while(retry != 0 && !connected){
         printf("   -Sending SET command\n");
-        sendSFrame(AT, SET);
+        unsigned char options = optionsByte(requestedCheck, requestedRaw);
+        if(options == 0) sendSFrame(AT, SET);
+        else sendSFrameValue(AT, SET | OPTIONS, options);
         alarm(timeout);
         alarmTriggered = FALSE;
 
         printf("   -Receiving UA command\n");
-        while(alarmTriggered == FALSE && STOP == FALSE){
-            if(read(fd, &byte, 1) > 0){
-                readSFrame(&*state, AR, UA);
-            }
-        }
+        connected = waitSFrame(AR, UA, TRUE);
         retry--;
     }
-    return STOP == FALSE ? -1 : 0;
+    if(!connected) return -1;
+
+    // A plain UA means the receiver keeps the XOR check
+    applyOptions();
+    if(frameCheck != requestedCheck) printf("   -Receiver declined %s\n", fcsName(requestedCheck));
+    if(rawFraming != requestedRaw) printf("   -Receiver declined length-prefixed framing\n");
+    if(frameCheck != FCS_XOR) printf("   -Frame Check [%s]\n", fcsName(frameCheck));
+    if(rawFraming) printf("   -Framing [length-prefixed]\n");
+    return 0;
 }
 
-int testConnection_Rx(STATE *state){
+int testConnection_Rx(){
     printf("   -Receiving SET command\n");
-    while(STOP == FALSE){
-        if (read(fd, &byte, 1) > 0){
-            readSFrame(&*state, AT, SET);
-        }
-    }
+    waitSFrame(AT, SET, FALSE);
+
+    // Every frame check and framing is supported, so the ones asked for are taken
+    applyOptions();
+    if(frameCheck != FCS_XOR) printf("   -Frame Check [%s]\n", fcsName(frameCheck));
+    if(rawFraming) printf("   -Framing [length-prefixed]\n");
 
     printf("   -Sending UA command\n");
-    return sendSFrame(AR, UA);
+    return sendUA();
 }
 
-void closeConnection_Tx(STATE *state, int retransmissions, int timeout){
+void closeConnection_Tx(int retransmissions, int timeout){
     (void) signal(SIGALRM, alarmHandler);
-    int retry = retransmissions;
+    int retry = retransmissions, disconnected = FALSE;
 
-    while(retry != 0 && STOP == FALSE){
+    while(retry != 0 && !disconnected){
         printf("   -Sending DISC command\n");
         sendSFrame(AT, DISC);
         alarm(timeout);
         alarmTriggered = FALSE;
 
         printf("   -Receiving DISC command\n");
-        while(alarmTriggered == FALSE && STOP == FALSE){
-            if(read(fd, &byte, 1) > 0){
-                readSFrame(&*state, AR, DISC);
-            }
-        }
+        disconnected = waitSFrame(AR, DISC, TRUE);
         retry--;
     }
 
@@ -212,25 +362,30 @@ void closeConnection_Tx(STATE *state, int retransmissions, int timeout){
     sendSFrame(AT, UA);
 }
 
-void closeConnection_Rx(STATE *state, int retransmissions, int timeout){
+// Answer the transmitter's DISC with ours. An application that read until
+// llread returned 0 has already taken the DISC; one that stopped at its END
+// packet has not, and the DISC is waited for here, as long as the transmitter
+// keeps sending it.
+void closeConnection_Rx(int retransmissions, int timeout){
     (void) signal(SIGALRM, alarmHandler);
-    int retry = retransmissions;
+    int retry = retransmissions, acknowledged = FALSE;
 
-    printf("   -Receiving DISC command\n");
-    readSFrame(&*state, AT, DISC);
+    if(!discReceived){
+        printf("   -Receiving DISC command\n");
+        alarm(retransmissions * timeout);
+        alarmTriggered = FALSE;
+        waitSFrame(AT, DISC, TRUE);
+        alarm(0);
+    }
 
-    while(retry != 0 && STOP == FALSE){
+    while(retry != 0 && !acknowledged){
         printf("   -Sending DISC command\n");
         sendSFrame(AR, DISC);
         alarm(timeout);
         alarmTriggered = FALSE;
 
         printf("   -Receiving UA command\n");
-        while(alarmTriggered == FALSE && STOP == FALSE){
-            if(read(fd, &byte, 1) > 0){
-                readSFrame(&*state, AT, UA);
-            }
-        }
+        acknowledged = waitSFrame(AT, UA, TRUE);
         retry--;
     }
 }
@@ -240,16 +395,22 @@ void closeConnection_Rx(STATE *state, int retransmissions, int timeout){
 ////////////////////////////////////////////////
 int llopen(LinkLayer connectionParameters){
     connParams = connectionParameters;
-    STATE state = START;    
     set_fd(connParams);
     if(fd < 0) return -1;
 
-    STOP = FALSE;
+    decoderInit(&decoder);
+    frameCheck = FCS_XOR;
+    rawFraming = FALSE;
+    codec = frameCodec(frameCheck, rawFraming);
+    rxStart = rxEnd = 0;
+    discReceived = FALSE;
+    myAddr = connParams.role == LlTx ? AT : AR;
+    peerAddr = connParams.role == LlTx ? AR : AT;
     if(connParams.role == LlTx){
-        if(testConnection_Tx(&state, connParams.nRetransmissions, connParams.timeout) < 0)
+        if(testConnection_Tx(connParams.nRetransmissions, connParams.timeout) < 0)
             return -1;
     } else{
-        if(testConnection_Rx(&state) < 0)
+        if(testConnection_Rx() < 0)
             return -1;
     }
 
@@ -257,87 +418,93 @@ int llopen(LinkLayer connectionParameters){
 }
 
 
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize){
+// Send buf in one information frame and wait for it to be acknowledged.
+// "aggregated" marks a payload made of several packets, each after a SUB_HEADER.
+int writeIFrame(const unsigned char *buf, int bufSize, int aggregated){
+    PROF_BEGIN(PROF_LLWRITE);
     (void) signal(SIGALRM, alarmHandler);
     unsigned char C = frameNumTx == 0 ? CI_0 : CI_1;
-    unsigned char bcc1 = AT ^ C; //BCC1
-    
-    unsigned char bcc2 = 0;
-    int newBuffSize = 0;
-
-    for(int i = 0; i < bufSize; i++){
-        bcc2 = bcc2 ^ buf[i];
-        if(buf[i] == FLAG || buf[i] == ESC_B1)
-            newBuffSize += 2;
-        else 
-            newBuffSize++;
-    }
-    if(bcc2 == FLAG || bcc2 == ESC_B1) newBuffSize++;
-    unsigned int frameSize = newBuffSize + 6; // buf contains data 
-    unsigned char *frame = (unsigned char *) malloc(frameSize);
+    if(duplex && recvNum == 1) C |= NR_BIT;   // piggybacked acknowledgement
+    if(aggregated) C |= AGG_BIT;
 
-    frame[0] = FLAG;
-    frame[1] = AT;
-    frame[2] = C;
-    frame[3] = bcc1;
-
-    int pos = 4;
-
-    for(int i = 0; i < bufSize; i++){
-        if(buf[i] == FLAG){
-            frame[pos++] = ESC_B1;
-            frame[pos++] = ESC_B2;
-        }
-        else if(buf[i] == ESC_B1){
-            frame[pos++] = ESC_B1;
-            frame[pos++] = ESC_B3;
-        }
-        else{
-            frame[pos++] = buf[i];
-        }
-    }
- 
-    if(bcc2 == FLAG){
-        frame[frameSize-3] = ESC_B1;
-        frame[frameSize-2] = ESC_B2;
-    }
-    else if(bcc2 == ESC_B1){
-        frame[frameSize-3] = ESC_B1;
-        frame[frameSize-2] = ESC_B3;
-    }
-    else{
-        frame[frameSize-2] = bcc2;
-    }
-    frame[frameSize-1] = FLAG;
+    // BCC2: XOR of the data, or the CRC agreed at llopen
+    PROF_BEGIN(PROF_STUFFING);
+    unsigned char *frame = (unsigned char *) malloc(FRAME_MAX(bufSize));
+    unsigned int frameSize = codecEncode(codec, myAddr, C, buf, bufSize, frame);
+    PROF_END(PROF_STUFFING);
 
     // verify if transmission was successful
+    unsigned char rrNext = frameNumTx == 0 ? RR1 : RR0, rnrNext = frameNumTx == 0 ? RNR1 : RNR0;
+    unsigned char rrCur = frameNumTx == 0 ? RR0 : RR1, rnrCur = frameNumTx == 0 ? RNR0 : RNR1;
     int retransmission = connParams.nRetransmissions;
+    int polls = RNR_POLLS;
     int accepted = FALSE;
+    int busy = peerCredit == 0;   // receiver has no room: hold the frame until it advertises credit
+    int sent = FALSE, resend = !busy;
 
-    while(retransmission > 0 && !accepted){
+    if(busy) printf("    -Waiting for Receiver credit\n");
+
+    while(retransmission > 0 && polls > 0 && !accepted){
         alarm(connParams.timeout);
         alarmTriggered = FALSE;
 
         while(alarmTriggered == FALSE && !accepted){
-            printf("    -Sending Data [%d Bytes]\n", bufSize);
-            write(fd, frame, frameSize);
+            if(resend){
+                printf("    -Sending Data [%d Bytes]\n", bufSize);
+                PROF_BEGIN(PROF_WRITE);
+                write(fd, frame, frameSize);
+                PROF_END(PROF_WRITE);
+                ackPending = FALSE;
+                sent = TRUE;
+                resend = FALSE;
+            }
+            PROF_BEGIN(PROF_ACK_WAIT);
             unsigned char response = readCFrame();
+            PROF_END(PROF_ACK_WAIT);
 
-            if(response == RR0 || response == RR1){
+            if(response == rrNext || response == rnrNext){
                 packetsReceived++;
                 accepted = TRUE;
+                peerCredit = lastCredit;
                 frameNumTx = (frameNumTx + 1) % 2;
             }
-            else packetsRejected++;
+            else if(response == rnrCur){
+                // Receiver is alive but stalled: stop retransmitting and wait for credit
+                if(!busy) printf("    -Receiver Not Ready\n");
+                busy = TRUE;
+                packetsDeferred++;
+            }
+            else if(response == rrCur){
+                // Receiver has room again. A frame already sent is still queued there, so just restart the timer
+                // (a duplex peer drops frames it has no room for, so send it again)
+                busy = FALSE;
+                if(sent && !duplex) alarm(connParams.timeout);
+                else resend = TRUE;
+            }
+            else if(response != 0){
+                packetsRejected++;
+                if(!busy) resend = TRUE;
+            }
+        }
+
+        if(accepted) break;
+        if(busy){
+            // Poll the receiver in case its credit advertisement was lost. A duplex peer answers
+            // the frame itself, since its RR frames acknowledge our frames rather than poll
+            if(duplex) resend = TRUE;
+            else sendSFrame(myAddr, rrCur);
+            polls--;
+        }
+        else{
+            packetsRejected++;
+            retransmission--;
+            resend = TRUE;
         }
-        retransmission--;
     }
 
     totalPackets++;
     free(frame);
+    PROF_END(PROF_LLWRITE);
     if(accepted == TRUE)
         return 0;
 
@@ -345,86 +512,186 @@ int llwrite(const unsigned char *buf, int bufSize){
 }
 
 ////////////////////////////////////////////////
-// LLREAD
+// LLWRITE
 ////////////////////////////////////////////////
-int llread(unsigned char *packet){
-    STATE state = START;
-    unsigned char c = 0;
-    int index = 0;
-    unsigned char aux = 0;  // neutral element of the XOR operation
-    STOP = FALSE;
-
-    while(STOP == FALSE){
-        if (read(fd, &byte, 1) > 0){
-            switch(state){
-                case START:
-                    if(byte == FLAG) state = FLAG_RCV;
-                    break;
-                case FLAG_RCV:
-                    if(byte == AT) state = A_RCV;
-                    else if(byte != FLAG) state = START;
-                    break;
-                case A_RCV:
-                    if(byte == (frameNumTx == 0 ? CI_0 : CI_1)){
-                        state = C_RCV;
-                        c = byte;
-                    }
-                    else if(byte == FLAG) state = FLAG_RCV;
-                    else if(byte == DISC) return 0;
-                    else state = START;
-                    break;
-                case C_RCV:
-                    if(byte == (AT ^ c)) state = READING;
-                    else if (byte == FLAG) state = FLAG_RCV;
-                    else state = START;
-                    break;
-                case READING:
-                    if(byte == ESC_B1) state = BYTE_STUFF;
-                    else if(byte == FLAG){
-                        packet[--index] = 0;
-                        if(aux == 0){
-                            STOP = TRUE;
-                            sendSFrame(AR, frameNumRx == 1 ? RR1 : RR0);
-                            frameNumRx = frameNumRx == 0 ? 1 : 0;
-                            frameNumTx = frameNumTx == 0 ? 1 : 0;
-                            packetsReceived++;
-                            totalPackets++;
-                            return index;
-                        }
-                        else{
-                            printf("[Error - Rejected Package]\n");
-                            sendSFrame(AR, (frameNumRx == 0 ? REJ0 : REJ1));
-                            packetsRejected++;
-                            totalPackets++;
-                            return -1;
-                        }
-                    }
-                    else{
-                        packet[index++] = byte;
-                        aux ^= byte;
-                    }
-                    break;
-                case BYTE_STUFF:
-                    state = READING;
-                    if(byte == ESC_B2){
-                        packet[index++] = FLAG;
-                    }
-                    else if(byte == ESC_B3){
-                        packet[index++] = ESC_B1;
-                    }
-                    else{
-                        printf("[Error - Rejected Package - BYTE STUFF ERROR]\n");
-                        sendSFrame(AR, (frameNumRx == 0 ? REJ0 : REJ1));
-                        return -1;
-                    }
-                    aux ^= packet[index-1];
-                    break;
-                default:
-                    break;
+int llwrite(const unsigned char *buf, int bufSize){
+    // Packets queued before this one leave first
+    if(llflush() < 0) return -1;
+    return writeIFrame(buf, bufSize, FALSE);
+}
+
+////////////////////////////////////////////////
+// LLQUEUE
+////////////////////////////////////////////////
+int llqueue(const unsigned char *buf, int bufSize){
+    if(bufSize <= 0 || bufSize > MAX_PAYLOAD_SIZE) return -1;
+
+    if(aggOutSize + SUB_HEADER + bufSize > MAX_PAYLOAD_SIZE && llflush() < 0)
+        return -1;
+    if(SUB_HEADER + bufSize > MAX_PAYLOAD_SIZE)   // too big to share a frame
+        return writeIFrame(buf, bufSize, FALSE);
+
+    aggOut[aggOutSize++] = (bufSize >> 8) & 0xFF;
+    aggOut[aggOutSize++] = bufSize & 0xFF;
+    memcpy(aggOut + aggOutSize, buf, bufSize);
+    aggOutSize += bufSize;
+    aggOutCount++;
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LLFLUSH
+////////////////////////////////////////////////
+int llflush(){
+    if(aggOutCount == 0){
+        // Nothing for an acknowledgement to ride on
+        if(ackPending) sendReady(recvNum);
+        return 0;
+    }
+
+    // A lone packet goes in a plain frame
+    int result = aggOutCount == 1 ? writeIFrame(aggOut + SUB_HEADER, aggOutSize - SUB_HEADER, FALSE)
+                                  : writeIFrame(aggOut, aggOutSize, TRUE);
+    aggOutSize = aggOutCount = 0;
+    return result;
+}
+
+// Copy the next packet of the aggregated frame in aggIn to packet.
+// Return its size, or "0" when none is left.
+int nextSubPacket(unsigned char *packet){
+    if(aggInPos + SUB_HEADER > aggInSize) return 0;
+
+    int size = (aggIn[aggInPos] << 8) | aggIn[aggInPos + 1];
+    if(size == 0 || aggInPos + SUB_HEADER + size > aggInSize){
+        printf("[Error - Malformed Aggregated Frame]\n");
+        aggInSize = aggInPos = 0;
+        return 0;
+    }
+
+    memcpy(packet, aggIn + aggInPos + SUB_HEADER, size);
+    aggInPos += SUB_HEADER + size;
+    return size;
+}
+
+// Read the next information frame into packet. "aggregated" is set when it holds several packets.
+// Return its size, "0" on DISC or "-1" when it was rejected.
+int readIFrame(unsigned char *packet, int *aggregated){
+    PROF_BEGIN(PROF_LLREAD);
+    Frame frame;
+
+    while(!duplex || rxQueued == 0){
+        // Nothing of ours went out since the last frame was accepted, so acknowledge it on its own
+        if(ackPending) sendReady(recvNum);
+
+        readFrame(&frame, duplex ? queueSlot() : packet, MAX_PAYLOAD_SIZE, FALSE);
+        if(frame.a != peerAddr) continue;
+
+        if(frame.kind == FRAME_S){
+            if(frame.c == DISC){
+                discReceived = TRUE;
+                PROF_END(PROF_LLREAD);
+                return 0;
             }
+            if((frame.c & ~OPTIONS) == SET) sendUA();   // our UA was lost
+            else if(!duplex && (frame.c == RR0 || frame.c == RR1)) sendReady(recvNum);    // poll from a transmitter waiting on our credit
+            continue;
+        }
+
+        if(duplex){
+            // The application is likely to answer, so try to piggyback the acknowledgement
+            queueIFrame(&frame, TRUE);
+            continue;
         }
+
+        int accepted = checkIFrame(&frame);
+        if(accepted == 0) continue;
+        if(accepted > 0) sendReady(recvNum);
+        *aggregated = (frame.c & AGG_BIT) != 0;
+        PROF_END(PROF_LLREAD);
+        return accepted > 0 ? frame.size : -1;
     }
-    return -1;
+
+    int size = rxQueueSize[rxHead];
+    *aggregated = rxQueueAgg[rxHead];
+    memcpy(packet, rxQueue[rxHead], size);
+    rxHead = (rxHead + 1) % RX_QUEUE;
+    rxQueued--;
+    if(rnrSent && currentCredit() > 0) sendReady(recvNum);   // a slot is free again
+
+    PROF_END(PROF_LLREAD);
+    return size;
+}
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int llread(unsigned char *packet){
+    int size = nextSubPacket(packet);
+    if(size > 0) return size;
+
+    int aggregated = FALSE;
+    while(TRUE){
+        size = readIFrame(packet, &aggregated);
+        if(size <= 0 || !aggregated) return size;
+
+        memcpy(aggIn, packet, size);
+        aggInSize = size;
+        aggInPos = 0;
+        if((size = nextSubPacket(packet)) > 0) return size;
+    }
+}
+
+
+////////////////////////////////////////////////
+// LLSETCREDIT
+////////////////////////////////////////////////
+int llsetcredit(int credit){
+    if(credit < 0) return -1;
+    localCredit = credit > MAX_CREDIT ? MAX_CREDIT : credit;
+
+    // Tell the transmitter right away, it may be holding or retransmitting a frame
+    if(fd >= 0 && (connParams.role == LlRx || duplex) && sendReady(recvNum) < 0)
+        return -1;
+
+    return 1;
+}
+
+
+////////////////////////////////////////////////
+// LLSETDUPLEX
+////////////////////////////////////////////////
+int llsetduplex(int enable){
+    if(fd >= 0) return -1;
+    duplex = enable ? TRUE : FALSE;
+    return 1;
+}
+
+
+////////////////////////////////////////////////
+// LLSETCHECK
+////////////////////////////////////////////////
+int llsetcheck(int type){
+    if(fd >= 0 || type < 0 || type >= FCS_TYPES) return -1;
+    requestedCheck = type;
+    return 1;
+}
+
+
+////////////////////////////////////////////////
+// LLSETFRAMING
+////////////////////////////////////////////////
+int llsetframing(int lengthPrefixed){
+    if(fd >= 0) return -1;
+    requestedRaw = lengthPrefixed != 0;
+    return 1;
+}
+
+
+////////////////////////////////////////////////
+// LLPENDING
+////////////////////////////////////////////////
+int llpending(){
+    return duplex ? rxQueued : 0;
 }
 
 
@@ -432,13 +699,13 @@ int llread(unsigned char *packet){
 // LLCLOSE
 ////////////////////////////////////////////////
 int llclose(int showStatistics){
-    STATE state = START;
-    STOP = FALSE;
+    if(llflush() < 0) printf("[ERROR - Couldnt Send Queued Packets]\n");
+    if(ackPending) sendReady(recvNum);
 
     if(connParams.role == LlTx)
-        closeConnection_Tx(&state, connParams.nRetransmissions, connParams.timeout);
+        closeConnection_Tx(connParams.nRetransmissions, connParams.timeout);
     else
-        closeConnection_Rx(&state, connParams.nRetransmissions, connParams.timeout);
+        closeConnection_Rx(connParams.nRetransmissions, connParams.timeout);
 
     // Restore the old port settings
     if (tcsetattr(fd, TCSANOW, &oldtio) == -1){
@@ -451,8 +718,10 @@ int llclose(int showStatistics){
         printf("Total Packets Sent/Received: %d\n", totalPackets);
         printf("Total Accepted Packets: %d/%d: %.2f%%\n", packetsReceived, totalPackets, (packetsReceived/totalPackets)*100.0);
         printf("Total Accepted Packets: %d/%d: %.2f%%\n", packetsRejected, totalPackets, (packetsRejected/totalPackets)*100.0);
+        printf("Receiver Not Ready Notices: %d\n", packetsDeferred);
     }
 
     close(fd);
+    fd = -1;
     return 0;
 }
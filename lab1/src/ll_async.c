@@ -0,0 +1,272 @@
+// Asynchronous link layer interface: a worker thread runs the blocking link layer
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "link_layer.h"
+#include "link_layer_ext.h"
+#include "ll_async.h"
+#include "utils.h"
+
+#define SUBMIT_QUEUE 256    // Buffers waiting to be sent
+
+typedef struct {
+    const unsigned char *buf;
+    int size;
+    void *user;
+} Submission;
+
+static LinkLayer asyncParams;
+static LlCallback eventCallback = NULL;
+static void *callbackArg = NULL;
+
+static pthread_t workerThread;
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submitted = PTHREAD_COND_INITIALIZER;    // a buffer was queued, or stopping was set
+static pthread_cond_t ringSpace = PTHREAD_COND_INITIALIZER;    // the caller collected events
+static pthread_cond_t workerState = PTHREAD_COND_INITIALIZER;  // the worker waits on a full ring, or is done
+
+static int eventFd = -1;
+static int running = FALSE;
+static int stopping = FALSE;
+static int workerDone = FALSE;
+static int closeStatistics = FALSE;
+static int closeResult = 1;
+
+static Submission submissions[SUBMIT_QUEUE];
+static int subHead = 0, subTail = 0;
+
+static LlEvent ring[LL_EVENT_RING];
+static int ringHead = 0, ringCount = 0;
+
+// Queue an event for the caller and wake its event loop.
+// When the ring is full the worker waits; on the receiver the transmitter is paused with RNR meanwhile.
+static void postEvent(LlEvent event){
+    pthread_mutex_lock(&asyncLock);
+    if(ringCount == LL_EVENT_RING) pthread_cond_signal(&workerState);
+    if(ringCount == LL_EVENT_RING && asyncParams.role == LlRx){
+        pthread_mutex_unlock(&asyncLock);
+        llsetcredit(0);
+        pthread_mutex_lock(&asyncLock);
+        while(ringCount == LL_EVENT_RING)
+            pthread_cond_wait(&ringSpace, &asyncLock);
+        pthread_mutex_unlock(&asyncLock);
+        llsetcredit(DEFAULT_CREDIT);
+        pthread_mutex_lock(&asyncLock);
+    }
+    while(ringCount == LL_EVENT_RING)
+        pthread_cond_wait(&ringSpace, &asyncLock);
+
+    ring[(ringHead + ringCount) % LL_EVENT_RING] = event;
+    ringCount++;
+    pthread_mutex_unlock(&asyncLock);
+
+    uint64_t one = 1;
+    write(eventFd, &one, sizeof(one));
+}
+
+static void transmitterLoop(){
+    pthread_mutex_lock(&asyncLock);
+    while(TRUE){
+        while(subHead == subTail && !stopping)
+            pthread_cond_wait(&submitted, &asyncLock);
+        if(subHead == subTail) break;
+
+        Submission s = submissions[subHead];
+        pthread_mutex_unlock(&asyncLock);
+
+        LlEvent event = {llwrite(s.buf, s.size) < 0 ? LlSendFailed : LlSent, s.buf, NULL, s.size, s.user};
+        postEvent(event);
+
+        pthread_mutex_lock(&asyncLock);
+        subHead = (subHead + 1) % SUBMIT_QUEUE;
+    }
+    pthread_mutex_unlock(&asyncLock);
+}
+
+static void receiverLoop(){
+    while(TRUE){
+        unsigned char *frame = (unsigned char *) malloc(MAX_PAYLOAD_SIZE);
+        int size = llread(frame);
+
+        if(size == 0){  // DISC from the transmitter
+            free(frame);
+            break;
+        }
+        if(size < 0){   // rejected, the transmitter will retry
+            free(frame);
+            continue;
+        }
+
+        LlEvent event = {LlReceived, NULL, frame, size, NULL};
+        postEvent(event);
+    }
+}
+
+static void *worker(void *unused){
+    sigset_t alarmSet;
+    sigemptyset(&alarmSet);
+    sigaddset(&alarmSet, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &alarmSet, NULL);
+
+    int opened = llopen(asyncParams) < 0 ? -1 : 1;
+    LlEvent event = {LlOpened, NULL, NULL, opened, NULL};
+    postEvent(event);
+
+    if(opened > 0){
+        if(asyncParams.role == LlTx) transmitterLoop();
+        else receiverLoop();
+        closeResult = llclose(closeStatistics) < 0 ? -1 : 1;
+    }
+
+    LlEvent closed = {LlClosed, NULL, NULL, 0, NULL};
+    postEvent(closed);
+
+    pthread_mutex_lock(&asyncLock);
+    workerDone = TRUE;
+    pthread_cond_signal(&workerState);
+    pthread_mutex_unlock(&asyncLock);
+    return NULL;
+}
+
+////////////////////////////////////////////////
+// LLOPENASYNC
+////////////////////////////////////////////////
+int llopenasync(LinkLayer connectionParameters, LlCallback callback, void *arg){
+    if(running) return -1;
+
+    asyncParams = connectionParameters;
+    eventCallback = callback;
+    callbackArg = arg;
+    subHead = subTail = 0;
+    ringHead = ringCount = 0;
+    stopping = FALSE;
+    workerDone = FALSE;
+
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(eventFd < 0){
+        perror("eventfd");
+        return -1;
+    }
+
+    // The link layer timer must interrupt the worker, never the caller's event loop
+    sigset_t alarmSet;
+    sigemptyset(&alarmSet);
+    sigaddset(&alarmSet, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarmSet, NULL);
+
+    if(pthread_create(&workerThread, NULL, worker, NULL) != 0){
+        perror("pthread_create");
+        close(eventFd);
+        return -1;
+    }
+
+    running = TRUE;
+    return 1;
+}
+
+int lleventfd(){
+    return eventFd;
+}
+
+////////////////////////////////////////////////
+// LLSUBMIT
+////////////////////////////////////////////////
+int llsubmit(const unsigned char *buf, int bufSize, void *user){
+    if(!running || asyncParams.role != LlTx || bufSize <= 0 || bufSize > MAX_PAYLOAD_SIZE) return -1;
+
+    pthread_mutex_lock(&asyncLock);
+    if(stopping || (subTail + 1) % SUBMIT_QUEUE == subHead){
+        pthread_mutex_unlock(&asyncLock);
+        return -1;
+    }
+    Submission s = {buf, bufSize, user};
+    submissions[subTail] = s;
+    subTail = (subTail + 1) % SUBMIT_QUEUE;
+    pthread_cond_signal(&submitted);
+    pthread_mutex_unlock(&asyncLock);
+
+    return 1;
+}
+
+////////////////////////////////////////////////
+// LLPOLL
+////////////////////////////////////////////////
+int llpoll(LlEvent *events, int max){
+    // Clear the descriptor first: an event posted after this still leaves it readable
+    uint64_t pending;
+    read(eventFd, &pending, sizeof(pending));
+
+    pthread_mutex_lock(&asyncLock);
+    int n = ringCount < max ? ringCount : max;
+    for(int i = 0; i < n; i++){
+        events[i] = ring[ringHead];
+        ringHead = (ringHead + 1) % LL_EVENT_RING;
+    }
+    ringCount -= n;
+    if(ringCount > 0){
+        uint64_t one = 1;
+        write(eventFd, &one, sizeof(one));
+    }
+    pthread_cond_signal(&ringSpace);
+    pthread_mutex_unlock(&asyncLock);
+
+    return n;
+}
+
+////////////////////////////////////////////////
+// LLDISPATCH
+////////////////////////////////////////////////
+int lldispatch(){
+    LlEvent events[32];
+    int total = 0, n;
+
+    while((n = llpoll(events, 32)) > 0){
+        for(int i = 0; i < n; i++){
+            if(eventCallback != NULL) eventCallback(&events[i], callbackArg);
+            else if(events[i].type == LlReceived) free(events[i].data);
+        }
+        total += n;
+    }
+    return total;
+}
+
+////////////////////////////////////////////////
+// LLCLOSEASYNC
+////////////////////////////////////////////////
+int llcloseasync(int showStatistics){
+    if(!running) return -1;
+
+    // The transmitter drains its queue and disconnects. The receiver closes when the transmitter
+    // disconnects, so this only waits for it.
+    pthread_mutex_lock(&asyncLock);
+    stopping = TRUE;
+    closeStatistics = showStatistics;
+    pthread_cond_signal(&submitted);
+    pthread_mutex_unlock(&asyncLock);
+
+    // Sleep until the worker is done, collecting whenever it waits on a full ring
+    pthread_mutex_lock(&asyncLock);
+    while(!workerDone){
+        if(ringCount == LL_EVENT_RING){
+            pthread_mutex_unlock(&asyncLock);
+            lldispatch();
+            pthread_mutex_lock(&asyncLock);
+        }
+        else pthread_cond_wait(&workerState, &asyncLock);
+    }
+    pthread_mutex_unlock(&asyncLock);
+
+    pthread_join(workerThread, NULL);
+    lldispatch();
+
+    running = FALSE;
+    close(eventFd);
+    eventFd = -1;
+    return closeResult;
+}
@@ -0,0 +1,358 @@
+// Reliable one-to-many transfers
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "crc.h"
+#include "delta.h"
+#include "frame_decoder.h"
+#include "link_layer.h"
+#include "multicast.h"
+#include "utils.h"
+
+#define MC_DATA_SIZE    (MAX_PAYLOAD_SIZE - 5)          // File bytes per data packet, after the type and number
+#define MC_RANGES       ((MAX_PAYLOAD_SIZE - 6) / 6)    // Missing ranges per NACK
+#define MC_CLOSES       3                               // CLOSE is not answered, so it is sent a few times
+
+/* Packets. The transmitter numbers START 0 and the data 1 on */
+#define MC_START    1   // [1][packets 4][file size 8][name]
+#define MC_DATA     2   // [2][number 4][bytes]
+#define MC_POLL     3   // [3][round 2][packets 4]
+#define MC_NACK     4   // [4][id][round 2][ranges 2], then [first 4][count 2] per range
+#define MC_DONE     5   // [5][id][round 2]
+#define MC_CLOSE    6   // [6]
+
+static int port = -1;
+static struct termios oldtio;
+static FrameDecoder mcDecoder;
+static unsigned char rxBuf[RX_BUF_SIZE];
+static int rxStart = 0, rxEnd = 0;
+static unsigned char frameBuf[FRAME_MAX(MAX_PAYLOAD_SIZE)];
+
+static long long nowMs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+// Same port settings as the link layer.
+static int openPort(const char *serialPort, int baudRate){
+    port = open(serialPort, O_RDWR | O_NOCTTY);
+    if(port < 0){
+        perror(serialPort);
+        return -1;
+    }
+    if(tcgetattr(port, &oldtio) == -1){
+        perror("tcgetattr");
+        return -1;
+    }
+
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+    newtio.c_cflag = baudRate | CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_cc[VTIME] = 0;
+    newtio.c_cc[VMIN] = 0;     // poll() does the waiting
+    tcflush(port, TCIOFLUSH);
+    if(tcsetattr(port, TCSANOW, &newtio) == -1){
+        perror("tcsetattr");
+        return -1;
+    }
+
+    // The frames of every receiver are protected by a CRC: there is no SET/UA to agree on one
+    decoderInit(&mcDecoder);
+    decoderSetCheck(&mcDecoder, FCS_CRC32C);
+    rxStart = rxEnd = 0;
+    return 0;
+}
+
+static void closePort(){
+    tcsetattr(port, TCSANOW, &oldtio);
+    close(port);
+    port = -1;
+}
+
+// Send one packet in a frame of our own, with no acknowledgement.
+static int sendPacket(unsigned char A, const unsigned char *packet, int size){
+    int frameSize = encodeFrame(A, CI_0, packet, size, FCS_CRC32C, frameBuf);
+    for(int done = 0; done < frameSize; ){
+        int n = write(port, frameBuf + done, frameSize - done);
+        if(n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Read the next good packet sent with address "from", waiting at most ms milliseconds.
+// Return its size or "-1" on timeout.
+static int readPacket(unsigned char from, unsigned char *packet, int ms){
+    long long deadline = nowMs() + ms;
+    Frame frame;
+    decoderSetPayload(&mcDecoder, packet, MAX_PAYLOAD_SIZE);
+
+    while(TRUE){
+        while(rxStart < rxEnd){
+            rxStart += decodeFrame(&mcDecoder, rxBuf + rxStart, rxEnd - rxStart, &frame);
+            if(frame.kind == FRAME_I && frame.a == from) return frame.size;
+        }
+
+        long long left = deadline - nowMs();
+        if(left <= 0) return -1;
+        struct pollfd p = {port, POLLIN, 0};
+        if(poll(&p, 1, left) > 0){
+            int bytes = read(port, rxBuf, RX_BUF_SIZE);
+            if(bytes > 0){
+                rxStart = 0;
+                rxEnd = bytes;
+            }
+        }
+    }
+}
+
+// Transmitter: send packet number n of the file.
+static int sendNumbered(int fileFd, long n, long packets, long fileSize, const char *filename){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+
+    if(n == 0){
+        int L = strlen(filename);
+        if(L > MAX_PAYLOAD_SIZE - 13) L = MAX_PAYLOAD_SIZE - 13;
+        packet[0] = MC_START;
+        putBE(packet + 1, packets, 4);
+        putBE(packet + 5, fileSize, 8);
+        memcpy(packet + 13, filename, L);
+        return sendPacket(AM, packet, 13 + L);
+    }
+
+    packet[0] = MC_DATA;
+    putBE(packet + 1, n, 4);
+    int size = pread(fileFd, packet + 5, MC_DATA_SIZE, (n - 1) * MC_DATA_SIZE);
+    if(size <= 0){
+        printf("[ERROR - Couldnt Read File]\n");
+        return -1;
+    }
+    return sendPacket(AM, packet, 5 + size);
+}
+
+int mcSend(const char *serialPort, int baudRate, int receivers, int nTries, int timeout, const char *filename){
+    if(receivers < 1 || receivers > 255){
+        printf("[ERROR - Between 1 and 255 receivers]\n");
+        return -1;
+    }
+    int fileFd = open(filename, O_RDONLY);
+    if(fileFd < 0){
+        printf("file not found\n");
+        return -1;
+    }
+    if(openPort(serialPort, baudRate) < 0){
+        close(fileFd);
+        return -1;
+    }
+
+    long fileSize = lseek(fileFd, 0, SEEK_END);
+    long packets = 1 + (fileSize + MC_DATA_SIZE - 1) / MC_DATA_SIZE;
+    unsigned char *need = (unsigned char *) malloc(packets);          // Packets to send in this round
+    unsigned char *done = (unsigned char *) calloc(receivers + 1, 1);
+    unsigned char *answered = (unsigned char *) malloc(receivers + 1);
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int remaining = receivers, round = 0, silent = 0;
+    long repairs = 0;
+
+    memset(need, 1, packets);
+    printf("   -Sending [%ld Packets to %d Receivers]\n", packets, receivers);
+
+    while(remaining > 0 && silent < nTries){
+        long count = 0;
+        for(long n = 0; n < packets; n++){
+            if(!need[n]) continue;
+            if(sendNumbered(fileFd, n, packets, fileSize, filename) < 0) goto end;
+            need[n] = 0;
+            count++;
+        }
+        if(round > 0 && count > 0){
+            printf("   -Repairing [%ld Packets]\n", count);
+            repairs += count;
+        }
+
+        round++;
+        printf("   -Polling Receivers [Round %d]\n", round);
+        packet[0] = MC_POLL;
+        putBE(packet + 1, round, 2);
+        putBE(packet + 3, packets, 4);
+        if(sendPacket(AM, packet, 7) < 0) goto end;
+
+        // Every receiver not done yet answers once per round, missing packets are merged into "need"
+        memset(answered, 0, receivers + 1);
+        int polled = remaining, waiting = remaining;
+        long long deadline = nowMs() + timeout * 1000LL;
+        while(waiting > 0){
+            long long left = deadline - nowMs();
+            if(left <= 0) break;
+            int size = readPacket(AR, packet, left);
+            if(size < 4) continue;
+
+            int id = packet[1];
+            if(id < 1 || id > receivers || (int) getBE(packet + 2, 2) != round || answered[id] || done[id]) continue;
+            answered[id] = TRUE;
+            waiting--;
+
+            if(packet[0] == MC_DONE){
+                printf("    -Receiver %d Done\n", id);
+                done[id] = TRUE;
+                remaining--;
+            }
+            else if(packet[0] == MC_NACK && size >= 6){
+                int ranges = getBE(packet + 4, 2);
+                for(int i = 0; i < ranges && 6 + 6 * (i + 1) <= size; i++){
+                    long first = getBE(packet + 6 + 6 * i, 4), length = getBE(packet + 10 + 6 * i, 2);
+                    for(long n = first; n < first + length && n < packets; n++) need[n] = 1;
+                }
+            }
+        }
+
+        // Receivers that stay silent are given up on after nTries polls in a row
+        if(waiting > 0) printf("    -%d Receivers Silent\n", waiting);
+        silent = waiting == polled ? silent + 1 : 0;
+    }
+
+end:
+    packet[0] = MC_CLOSE;
+    for(int i = 0; i < MC_CLOSES; i++) sendPacket(AM, packet, 1);
+
+    printf("\n---- STATISTICS ----\n");
+    printf("Packets: %ld, Repaired: %ld, Rounds: %d\n", packets, repairs, round);
+    printf("Receivers Done: %d/%d\n", receivers - remaining, receivers);
+
+    free(need);
+    free(done);
+    free(answered);
+    close(fileFd);
+    closePort();
+    return remaining == 0 ? 0 : -1;
+}
+
+// Receiver: record packet n. Return "1" when it is new.
+static int markPacket(unsigned char **have, long *haveSize, long n){
+    if(n >= *haveSize){
+        long size = *haveSize ? *haveSize : 1024;
+        while(size <= n) size *= 2;
+        *have = (unsigned char *) realloc(*have, size);
+        memset(*have + *haveSize, 0, size - *haveSize);
+        *haveSize = size;
+    }
+    if((*have)[n]) return 0;
+    (*have)[n] = 1;
+    return 1;
+}
+
+// Receiver: answer a poll with DONE, or with the ranges of packets still missing.
+static int answerPoll(int id, int round, const unsigned char *have, long haveSize, long packets, long got){
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    packet[1] = id;
+    putBE(packet + 2, round, 2);
+
+    if(got == packets){
+        packet[0] = MC_DONE;
+        return sendPacket(AR, packet, 4);
+    }
+
+    int ranges = 0;
+    for(long n = 0; n < packets && ranges < MC_RANGES; ){
+        if(n < haveSize && have[n]){
+            n++;
+            continue;
+        }
+        long first = n;
+        while(n < packets && !(n < haveSize && have[n]) && n - first < 0xFFFF) n++;
+        putBE(packet + 6 + 6 * ranges, first, 4);
+        putBE(packet + 10 + 6 * ranges, n - first, 2);
+        ranges++;
+    }
+    packet[0] = MC_NACK;
+    putBE(packet + 4, ranges, 2);
+    printf("   -Answering Poll [Round %d, %ld Missing]\n", round, packets - got);
+    return sendPacket(AR, packet, 6 + 6 * ranges);
+}
+
+int mcReceive(const char *serialPort, int baudRate, int id, int nTries, int timeout, const char *filename){
+    if(id < 1 || id > 255){
+        printf("[ERROR - Receiver id must be between 1 and 255]\n");
+        return -1;
+    }
+    int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0){
+        perror(filename);
+        return -1;
+    }
+    if(openPort(serialPort, baudRate) < 0){
+        close(out);
+        return -1;
+    }
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    unsigned char *have = NULL;     // Packets received, by number
+    long haveSize = 0, packets = -1, fileSize = -1, got = 0;
+    int closed = FALSE;
+    long long lastHeard = nowMs();
+
+    while(!closed){
+        int size = readPacket(AM, packet, 1000);
+        if(size <= 0){
+            // Transmitter gone
+            if(nowMs() - lastHeard > (long long) nTries * timeout * 1000) break;
+            continue;
+        }
+        lastHeard = nowMs();
+
+        switch(packet[0]){
+            case MC_START:
+                if(size < 13) break;
+                packets = getBE(packet + 1, 4);
+                fileSize = getBE(packet + 5, 8);
+                if(markPacket(&have, &haveSize, 0)){
+                    got++;
+                    printf("  -Receiving Control Field [START]\n");
+                }
+                break;
+
+            case MC_DATA:{
+                if(size < 5) break;
+                long n = getBE(packet + 1, 4);
+                if(n < 1 || (packets > 0 && n >= packets) || !markPacket(&have, &haveSize, n)) break;
+                if(pwrite(out, packet + 5, size - 5, (n - 1) * MC_DATA_SIZE) != size - 5){
+                    printf("[ERROR - Couldnt Write File]\n");
+                    have[n] = 0;
+                    break;
+                }
+                got++;
+                break;
+            }
+
+            case MC_POLL:
+                if(size < 7) break;
+                packets = getBE(packet + 3, 4);
+                answerPoll(id, getBE(packet + 1, 2), have, haveSize, packets, got);
+                break;
+
+            case MC_CLOSE:
+                closed = TRUE;
+                break;
+        }
+    }
+
+    int complete = packets > 0 && got == packets;
+    if(complete) ftruncate(out, fileSize);
+    else printf("[ERROR - Transfer Incomplete: %ld/%ld Packets]\n", got, packets);
+    printf("\n---- STATISTICS ----\n");
+    printf("Packets Received: %ld/%ld\n", got, packets);
+
+    free(have);
+    close(out);
+    closePort();
+    return complete ? 0 : -1;
+}
@@ -0,0 +1,127 @@
+// Hot path profiling probes (only built with -DPROFILE)
+
+#ifdef PROFILE
+
+#include <stdio.h>
+#include <time.h>
+#include "profile.h"
+
+#define MAX_DEPTH   8       // Deepest nesting of probes
+#define MAX_STACKS  64      // Distinct probe stacks kept for the folded output
+
+typedef struct {
+    PROF_PHASE phase;
+    long long start;        // ns
+    long long children;     // ns spent in nested probes
+} Probe;
+
+typedef struct {
+    int depth;
+    PROF_PHASE path[MAX_DEPTH];
+    long long self;         // ns
+} Stack;
+
+static const char *phaseNames[PROF_PHASES] = {
+    "llwrite", "llread", "file_read", "packet_build", "stuffing", "write_syscall",
+    "ack_wait", "read_syscall", "deframe_destuff", "bcc_check", "disk_write"
+};
+
+static Probe probes[MAX_DEPTH];
+static int depth = 0;
+
+static long long calls[PROF_PHASES];
+static long long total[PROF_PHASES];    // ns, including nested probes
+static long long self[PROF_PHASES];     // ns, excluding nested probes
+
+static Stack stacks[MAX_STACKS];
+static int nStacks = 0;
+
+static long long runStart = 0;
+
+static long long now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Charge "ns" of self time to the stack of currently open probes.
+static void addStack(long long ns){
+    for(int i = 0; i < nStacks; i++){
+        if(stacks[i].depth != depth) continue;
+        int j = 0;
+        while(j < depth && stacks[i].path[j] == probes[j].phase) j++;
+        if(j == depth){
+            stacks[i].self += ns;
+            return;
+        }
+    }
+
+    if(nStacks == MAX_STACKS) return;
+    stacks[nStacks].depth = depth;
+    for(int j = 0; j < depth; j++)
+        stacks[nStacks].path[j] = probes[j].phase;
+    stacks[nStacks++].self = ns;
+}
+
+void profBegin(PROF_PHASE phase){
+    long long t = now();
+    if(runStart == 0) runStart = t;
+    if(depth == MAX_DEPTH) return;
+
+    probes[depth].phase = phase;
+    probes[depth].start = t;
+    probes[depth].children = 0;
+    depth++;
+}
+
+void profEnd(PROF_PHASE phase){
+    int open = depth;
+    while(open > 0 && probes[open - 1].phase != phase) open--;
+    if(open == 0) return;
+
+    long long t = now();
+    while(depth >= open){
+        Probe *p = &probes[depth - 1];
+        long long elapsed = t - p->start;
+
+        calls[p->phase]++;
+        total[p->phase] += elapsed;
+        self[p->phase] += elapsed - p->children;
+        addStack(elapsed - p->children);
+
+        depth--;
+        if(depth > 0) probes[depth - 1].children += elapsed;
+    }
+}
+
+void profReport(const char *name){
+    long long wall = runStart == 0 ? 0 : now() - runStart;
+
+    printf("\n---- PROFILE (%s) ----\n", name);
+    printf("%-16s %10s %12s %12s %7s\n", "Phase", "Calls", "Total (ms)", "Self (ms)", "Self %");
+    for(int i = 0; i < PROF_PHASES; i++){
+        if(calls[i] == 0) continue;
+        printf("%-16s %10lld %12.3f %12.3f %6.2f%%\n", phaseNames[i], calls[i],
+               total[i] / 1e6, self[i] / 1e6, wall > 0 ? 100.0 * self[i] / wall : 0.0);
+    }
+    printf("Run time: %.3f ms\n", wall / 1e6);
+
+    char path[64];
+    snprintf(path, sizeof(path), "profile-%s.folded", name);
+    FILE *out = fopen(path, "w");
+    if(out == NULL){
+        perror(path);
+        return;
+    }
+
+    for(int i = 0; i < nStacks; i++){
+        fprintf(out, "%s", name);
+        for(int j = 0; j < stacks[i].depth; j++)
+            fprintf(out, ";%s", phaseNames[stacks[i].path[j]]);
+        fprintf(out, " %lld\n", stacks[i].self / 1000);
+    }
+    fclose(out);
+    printf("Flame graph stacks written to %s\n", path);
+}
+
+#endif // PROFILE
@@ -0,0 +1,215 @@
+// Frame decoder for cable captures.
+// Reads a pcapng file written by "cable -w" (see cable/capture.h) and prints
+// one line per frame: time since the first packet, lane, direction, the frame
+// (A, C and what they mean), its payload size and what the cable did to the
+// bytes it came in. Bytes the cable kept from the other side (dropped, cut,
+// cable off) are printed as they were lost. The frame check and framing
+// agreed in a UA with options are followed; a capture that starts later can
+// give them with -c and -r.
+//
+// Usage: capture_decode [-c xor|crc16|crc32|crc32c] [-r] [-q] capture.pcapng
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "frame_decoder.h"
+#include "link_layer.h"
+#include "utils.h"
+
+#define BLOCK_SHB 0x0A0D0D0A
+#define BLOCK_IDB 0x00000001
+#define BLOCK_EPB 0x00000006
+#define BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define CAPTURE_LINKTYPE 147        // As in cable/capture.h
+#define CAPTURE_HEADER 4
+#define MAX_LANES 256
+#define MAX_BLOCK (1 << 20)
+
+// MARK_* flags of cable/impair.h
+static const char *markNames[] = {"noise", "bit errors", "duplicate", "delayed", "dropped", "cut", "cable off"};
+#define MARKS (int) (sizeof(markNames) / sizeof(markNames[0]))
+#define LOST_MARKS 0x70
+
+typedef struct {
+    FrameDecoder d;
+    unsigned char payload[MAX_PAYLOAD_SIZE + FCS_MAX_SIZE];
+    long frames[4];                 // By FRAME_KIND
+    long lost;                      // Bytes that never reached the other side
+} Stream;
+
+static Stream streams[MAX_LANES][2];
+static const char *directions[2] = {"Tx>Rx", "Rx>Tx"};
+int quiet = FALSE;
+
+void printMarks(int marks){
+    for(int i = 0; i < MARKS; i++)
+        if(marks & (1 << i)) printf(" [%s]", markNames[i]);
+}
+
+// What a frame is, from its C field
+void describe(const Frame *f, char *out, int size){
+    if(f->kind == FRAME_I || f->kind == FRAME_BAD){
+        int n = snprintf(out, size, "I%d%s%s", (f->c & CI_1) != 0, f->c & NR_BIT ? " N(R)=1" : "",
+                         f->c & AGG_BIT ? " aggregated" : "");
+        if(f->kind == FRAME_BAD) snprintf(out + n, size - n, " BAD");
+        else snprintf(out + n, size - n, " %d Bytes", f->size);
+        return;
+    }
+
+    const char *name = "?";
+    switch(f->c & ~OPTIONS){
+        case SET: name = "SET"; break;
+        case UA: name = "UA"; break;
+        case DISC: name = "DISC"; break;
+        case RR0: name = "RR0"; break;
+        case RR1: name = "RR1"; break;
+        case REJ0: name = "REJ0"; break;
+        case REJ1: name = "REJ1"; break;
+        case RNR0: name = "RNR0"; break;
+        case RNR1: name = "RNR1"; break;
+    }
+    if(!(f->c & OPTIONS)) snprintf(out, size, "%s", name);
+    else if((f->c & ~OPTIONS) == SET || (f->c & ~OPTIONS) == UA)
+        snprintf(out, size, "%s %s%s", name, fcsName(f->credit & FCS_MASK), f->credit & RAW_FRAMING ? " length-prefixed" : "");
+    else snprintf(out, size, "%s credit %d", name, f->credit);
+}
+
+// Both directions of a lane take the frame check and framing a UA confirmed
+void followOptions(int lane, const Frame *f){
+    if(f->kind != FRAME_S || (f->c & ~OPTIONS) != UA || !(f->c & OPTIONS)) return;
+    const FrameCodec *codec = frameCodec(f->credit & FCS_MASK, (f->credit & RAW_FRAMING) != 0);
+    decoderSetCodec(&streams[lane][0].d, codec);
+    decoderSetCodec(&streams[lane][1].d, codec);
+}
+
+void packet(int lane, uint64_t ns, uint64_t first, const unsigned char *data, int n){
+    if(lane >= MAX_LANES || n < CAPTURE_HEADER) return;
+    int direction = data[0] & 1, marks = data[1];
+    Stream *s = &streams[lane][direction];
+    double t = (ns - first) / 1e9;
+    data += CAPTURE_HEADER;
+    n -= CAPTURE_HEADER;
+
+    if(marks & LOST_MARKS){
+        s->lost += n;
+        if(!quiet){
+            printf("%14.9f lane %d %s lost %d Bytes", t, lane, directions[direction], n);
+            printMarks(marks);
+            printf("\n");
+        }
+        return;
+    }
+
+    Frame f;
+    int pos = 0;
+    while(pos < n){
+        pos += decodeFrame(&s->d, data + pos, n - pos, &f);
+        if(f.kind == FRAME_NONE) continue;
+        s->frames[f.kind]++;
+        if(!quiet){
+            char what[96];
+            describe(&f, what, sizeof(what));
+            printf("%14.9f lane %d %s A=%02X C=%02X %s", t, lane, directions[direction], f.a, f.c, what);
+            printMarks(marks);
+            printf("\n");
+        }
+        followOptions(lane, &f);
+    }
+}
+
+int main(int argc, char *argv[]){
+    FCS_TYPE fcs = FCS_XOR;
+    int raw = FALSE, opt;
+
+    while((opt = getopt(argc, argv, "c:rq")) != -1){
+        switch(opt){
+            case 'c':
+                if(fcsType(optarg) < 0){
+                    printf("[ERROR - Unknown frame check %s]\n", optarg);
+                    return 1;
+                }
+                fcs = fcsType(optarg);
+                break;
+            case 'r': raw = TRUE; break;
+            case 'q': quiet = TRUE; break;
+            default:
+                printf("Usage: %s [-c xor|crc16|crc32|crc32c] [-r] [-q] capture.pcapng\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc - 1){
+        printf("Usage: %s [-c xor|crc16|crc32|crc32c] [-r] [-q] capture.pcapng\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if(file == NULL){
+        perror(argv[optind]);
+        return 1;
+    }
+
+    for(int k = 0; k < MAX_LANES; k++){
+        for(int d = 0; d < 2; d++){
+            decoderInit(&streams[k][d].d);
+            decoderSetPayload(&streams[k][d].d, streams[k][d].payload, MAX_PAYLOAD_SIZE);
+            decoderSetCodec(&streams[k][d].d, frameCodec(fcs, raw));
+        }
+    }
+
+    unsigned char *block = (unsigned char *) malloc(MAX_BLOCK);
+    uint32_t head[2];
+    uint64_t first = 0;
+    int interfaces = 0, lanes = 0;
+    long packets = 0;
+
+    while(fread(head, 4, 2, file) == 2){
+        if(head[1] < 12 || head[1] > MAX_BLOCK || head[1] % 4 != 0 ||
+           fread(block, 1, head[1] - 8, file) != head[1] - 8){
+            printf("[ERROR - Truncated or damaged block]\n");
+            break;
+        }
+
+        if(head[0] == BLOCK_SHB){
+            uint32_t magic;
+            memcpy(&magic, block, 4);
+            if(magic != BYTE_ORDER_MAGIC){
+                printf("[ERROR - Capture written with the other byte order]\n");
+                return 1;
+            }
+        }
+        else if(head[0] == BLOCK_IDB){
+            uint16_t linkType;
+            memcpy(&linkType, block, 2);
+            if(linkType != CAPTURE_LINKTYPE){
+                printf("[ERROR - Interface %d is not a cable lane (link type %d)]\n", interfaces, linkType);
+                return 1;
+            }
+            interfaces++;
+        }
+        else if(head[0] == BLOCK_EPB){
+            uint32_t epb[5];
+            memcpy(epb, block, sizeof(epb));
+            // The captured bytes must fit in the block
+            if(head[1] < 32 || epb[3] > head[1] - 32) continue;
+            uint64_t ns = ((uint64_t) epb[1] << 32) | epb[2];
+            if(packets++ == 0) first = ns;
+            if((int) epb[0] + 1 > lanes) lanes = epb[0] + 1;
+            packet(epb[0], ns, first, block + 20, epb[3]);
+        }
+    }
+    fclose(file);
+    free(block);
+
+    printf("---- CAPTURE ----\n");
+    printf("Packets: %ld, Lanes: %d\n", packets, interfaces);
+    for(int k = 0; k < lanes && k < MAX_LANES; k++){
+        for(int d = 0; d < 2; d++){
+            Stream *s = &streams[k][d];
+            printf("Lane %d %s: %ld I, %ld S/U, %ld bad frames, %ld Bytes lost\n", k, directions[d],
+                   s->frames[FRAME_I], s->frames[FRAME_S], s->frames[FRAME_BAD], s->lost);
+        }
+    }
+    return 0;
+}
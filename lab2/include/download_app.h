@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // splice, F_SETPIPE_SZ
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -10,6 +11,10 @@
 #include <libgen.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
 #include <errno.h>
 
 #define MAX_LENGTH  1024
@@ -17,16 +22,31 @@
 #define FALSE       0
 #define TRUE        1
 
+#define MAX_SEGMENTS    16
+#define MIN_SEGMENT     65536   // Smallest range worth its own connections
+#define DATA_CHUNK      (1 << 20) // Most bytes moved from a data connection at once
+#define MAX_SESSIONS    8       // Control connections per server for many files
+#define SESSION_LOST    255     // Exit status of a session that died
+#define MAX_HOSTS       64      // Host names looked up once
+#define STATE_SUFFIX    ".segments"
+#define STATE_RECORD    64      // Bytes per line of a state file
+#define STATE_INTERVAL  (1 << 20) // A segment's progress is saved every megabyte
+
 /* Server responses */
 #define AUTH_READY              220
 #define PWD_READY               331
 #define LOG_SUCCESS             230
+#define COMMAND_OK              200
+#define FILE_STATUS             213
+#define RESTART_PENDING         350
 #define PASSIVE_1               227
 #define PASSIVE_2               125
 #define TRANSFER_READY          150
 #define TRANSFER_COMPLETE       226
 #define END_CONNECTION          221
 
+#define USAGE "Usage: ./download [-n segments] [-p sessions] [-f list] ftp://[<user>:<password>@]<host>/<url-path> ..."
+
 /* Default credentials*/
 #define DFLT_USR        "anonymous"
 #define DFLT_PWD        "anonymous"
@@ -40,18 +60,54 @@ typedef struct {
     char ip[MAX_LENGTH];        // 193.137.29.15
 } URL;
 
+typedef struct {
+    long start;                 // First byte of the range
+    long end;                   // One past its last byte
+    long pos;                   // Next byte to fetch
+} Segment;
+
+typedef struct {
+    int pipe[2];                // Data goes socket > pipe > file with splice; -1 without
+    char *buffer;               // DATA_CHUNK bytes for when splice can't be used
+} DataPath;
+
 char response[MAX_LENGTH];
 
 int parseURL(char *input, URL *url);
+int resolveHost(const char *host, char *ip);
+int downloadResource(const int socketA, URL *url, int segments);
+int downloadFile(const int socketA, URL *url);
+void addURL(URL **urls, int *count, int *capacity, char *input);
+int compareFile(const void *a, const void *b);
+int compareURL(const void *a, const void *b);
+int sameServer(const URL *a, const URL *b);
+int downloadMany(char **args, int count, const char *list, int segments, int sessions);
+int downloadGroup(URL *urls, int *order, int count, int sessions, int segments);
+int runSession(URL *urls, int *order, int count, int first, int step, int segments);
 void getCredentials(char* args, URL *url);
 void getResource(char* path, URL *url);
 int createSocket(char *ip, int port);
+int openControl(URL *url);
 int readResponse(const int socket);
 int login(const int socket, const char* user, const char* pass);
 int passiveMode(const int socket, char *ip, int *port);
 int requestResource(const int socket, char *resource);
-int getFile(const int socketA, const int socketB, char *filename);
-int endConnection(const int socketA, const int socketB);
+int sendCommand(const int socket, const char *command, const char *arg);
+long getSize(const int socket, const char *resource);
+int restartAt(const int socket, long offset);
+time_t getModified(const int socket, const char *resource);
+long resumeOffset(const char *filename, long size, time_t modified);
+void statePath(const char *filename, char *path, int size);
+int loadState(const char *path, long size, time_t modified, Segment *table, int *segments);
+void saveRecord(int state, int index, const char *text);
+void saveSegment(int state, int index, const Segment *segment);
+void openDataPath(DataPath *path);
+long moveData(DataPath *path, int socket, int fd, long pos, long want);
+void closeDataPath(DataPath *path);
+int getSegment(const int socketA, URL *url, int fd, int state, int index, Segment *segment, int last);
+int downloadSegmented(const int socketA, URL *url, int segments);
+int getFile(const int socketA, const int socketB, char *filename, long offset);
+int endConnection(const int socketA);
 void handleError(const char *errorMessage);
 void handleErrorObject(const char *errorMessage, const char* object);
 void printConnParams(URL url);